@@ -33,8 +33,17 @@ this code doesn't check for limits (bad, bad, bad!)
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <cmath>
+#include <complex>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <sycl/sycl.hpp>
 
 #include "image_conv.h"
@@ -43,11 +52,3403 @@ inline constexpr int filterWidth = 44;
 // inline constexpr int filterWidth = 88;
 inline constexpr int halo = filterWidth / 2;
 
+// What main blurs with.  gaussian_iir runs on the recursive engine, so
+// its cost per pixel doesn't grow with its sigma.
+inline constexpr auto filterType = util::filter_type::blur;
+
+// Standard deviation of the gaussian_iir blur, in pixels.  It is not
+// tied to filterWidth: the recursive engine pads bands by how far its
+// recursion takes to settle (iir_settle_length), and the Gaussian taps
+// the host checks it against are generated for this sigma.
+inline constexpr float iirSigma = 12.0f;
+
+// Largest difference, relative to a filter's biggest weight, between
+// a filter and the product of its 1D factors that still counts as
+// separable.  Kernels loaded from a filter file (see main) are only as
+// exact as the digits they were written with.
+inline constexpr float separableTolerance = 1e-3f;
+
+// Range standard deviation of the bilateral filter, in 8-bit levels:
+// neighbours a few times this far from a pixel's value hardly count,
+// so edges stay sharp while flat areas are blurred.
+inline constexpr float bilateralSigma = 25.0f;
+
+// Gradient magnitude taken of the blurred picture, in the same kernel
+// as the blur (submit_edges).  none just blurs.
+enum class edge_operator { none, sobel, scharr };
+inline constexpr auto edgeOperator = edge_operator::none;
+
+// Canny edge detection instead of a plain blur: a Gaussian blur on
+// its usual engine is the smoothing step, then the Canny kernels
+// (submit_canny_classes on) thin its gradient and keep the strong
+// edges plus the weak ones connected to them.  The thresholds are
+// gradient magnitudes in levels per pixel, the scale submit_gradient
+// writes.
+inline constexpr bool canny = false;
+inline constexpr float cannyLow = 1.0f;
+inline constexpr float cannyHigh = 3.0f;
+static_assert(!canny || edgeOperator == edge_operator::none,
+              "Canny takes its own gradient");
+
+// Whether filterType is a convolution, which the edge and unsharp modes
+// build on.
+inline constexpr bool linearFilter =
+    filterType == util::filter_type::identity ||
+    filterType == util::filter_type::blur ||
+    filterType == util::filter_type::gaussian ||
+    filterType == util::filter_type::gaussian_iir;
+static_assert(edgeOperator == edge_operator::none || linearFilter,
+              "edge detection only blurs linearly");
+
+// Unsharp masking instead of a blur: in + unsharpAmount * (in -
+// blur(in)).  The blur engines apply it as they store each sample
+// (blur_result), with the pixel at the centre of the window they just
+// summed, so the blurred picture is never stored and takes no second
+// pass.  Needs a convolution as the filter.
+inline constexpr bool unsharpMask = false;
+inline constexpr float unsharpAmount = 1.0f;
+static_assert(!unsharpMask || (linearFilter && !canny &&
+                               edgeOperator == edge_operator::none),
+              "unsharp masking sharpens a plain blur");
+
+// A chain of stages run instead of the single filter (submit_chain).
+// Stencil stages read a neighbourhood: blur (with the filter main
+// generates) and gradient (magnitude, as submit_gradient takes it).
+// Point-wise stages read only the pixel: threshold (255 at or above
+// the level, 0 below), grayscale (Rec. 601 luma in every colour
+// channel) and scale (value * factor + offset).
+enum class stage_kind { blur, gradient, threshold, grayscale, scale };
+
+struct chain_stage {
+  stage_kind kind = stage_kind::blur;
+  edge_operator op = edge_operator::sobel;  // gradient
+  float level = 0.0f;                       // threshold
+  float factor = 1.0f;                      // scale
+  float offset = 0.0f;                      // scale
+  int reach = halo;                         // blur: the filter's half width
+
+  constexpr bool stencil() const {
+    return kind == stage_kind::blur || kind == stage_kind::gradient;
+  }
+  // Rows and columns of padding the stage uses up on every side.
+  constexpr int padding() const {
+    return kind == stage_kind::blur       ? reach
+           : kind == stage_kind::gradient ? 1
+                                          : 0;
+  }
+};
+
+// Stages declared one after the other, e.g.
+// filter_chain{}.grayscale().blur().gradient().threshold(32.0f).
+struct filter_chain {
+  static constexpr int maxStages = 8;
+  std::array<chain_stage, maxStages> stages{};
+  int size = 0;
+
+  // A blur with a filter `reach` pixels out from its centre; main's
+  // chains blur with the generated filter.
+  constexpr filter_chain blur(int reach = halo) const {
+    chain_stage stage{stage_kind::blur};
+    stage.reach = reach;
+    return with(stage);
+  }
+  constexpr filter_chain gradient(
+      edge_operator op = edge_operator::sobel) const {
+    return with({stage_kind::gradient, op});
+  }
+  constexpr filter_chain threshold(float level) const {
+    return with({stage_kind::threshold, edge_operator::none, level});
+  }
+  constexpr filter_chain grayscale() const {
+    return with({stage_kind::grayscale});
+  }
+  constexpr filter_chain scale(float factor, float offset = 0.0f) const {
+    return with({stage_kind::scale, edge_operator::none, 0.0f, factor, offset});
+  }
+
+  // Padding a band needs for the whole chain.
+  constexpr int padding() const {
+    int total = 0;
+    for (int k = 0; k < size; ++k) total += stages[k].padding();
+    return total;
+  }
+
+ private:
+  constexpr filter_chain with(chain_stage stage) const {
+    auto next = *this;
+    next.stages[next.size++] = stage;
+    return next;
+  }
+};
+
+// The chain main runs; an empty one means the plain filter.  Stages
+// go into as few kernels as local memory allows (submit_chain), so
+// e.g. filter_chain{}.grayscale().blur().gradient().threshold(32.0f)
+// is an edge map in one kernel that reads the picture once and writes
+// it once.
+inline constexpr auto filterChain = filter_chain{};
+inline constexpr bool chained = filterChain.size > 0;
+static_assert(!chained || (linearFilter && !canny && !unsharpMask &&
+                           edgeOperator == edge_operator::none),
+              "a filter chain replaces the other modes");
+static_assert(!chained || filterType != util::filter_type::gaussian_iir,
+              "a filter chain blurs with filterWidth taps, not by iirSigma");
+
+// What splitting a chain between two kernels costs, in multiply-adds
+// per sample: the intermediate's round trip through global memory and
+// one more launch.  A stencil joins the kernel before it only while
+// recomputing that kernel's wider ring costs less (chain_segments).
+inline constexpr int chainSplitTaps = 64;
+
+// Pad RGB pictures to RGBA so the separable engine can move whole
+// pixels as sycl::vec<float, 4>.  The pad channel gets an identity
+// filter from generate_filter, which also keeps a box blur off the
+// running-sum engine.
+inline constexpr bool padToRgba = false;
+
+// Read the picture without a halo and pad each band on the device
+// (submit_clamp_to_edge) instead of building a padded copy on the
+// host: bands then transfer only real rows, a saving of the halo area
+// (about 18% at halo 22 on a 512x512 picture).
+inline constexpr bool padOnDevice = true;
+
+// Planar (CHW) images keep each channel in its own plane, so every
+// kernel walks unit-stride single-channel rows, and whole planes
+// rather than bands of rows are dealt out to the queues.  Build with
+// -DPLANAR (make edge_planar) to compare against the interleaved
+// default.
+#ifdef PLANAR
+inline constexpr auto imageLayout = util::image_layout::planar;
+#else
+inline constexpr auto imageLayout = util::image_layout::interleaved;
+#endif
+
+// Sample type of the images the device sees.  With -DBYTEPIXELS (make
+// edge_bytes) pictures stay 8-bit all the way: a quarter of the host
+// memory and of the transfers.  With -DHALFPIXELS (make edge_half)
+// they are sycl::half, which holds every 8-bit level exactly and
+// halves the bytes the bandwidth-bound kernels move.  Kernels convert
+// samples to float as they load them and accumulate in float;
+// to_pixel stores the result.
+#if defined(BYTEPIXELS)
+using pixel_t = unsigned char;
+#elif defined(HALFPIXELS)
+using pixel_t = sycl::half;
+#else
+using pixel_t = float;
+#endif
+
+// How far an output sample may be from the exact convolution, in 8-bit
+// levels: bytes round to the nearest level, half rounds values up to
+// 255 to 1/16 of a level, and float accumulation of the widest
+// filters stays within 1/64.
+inline constexpr float outputTolerance =
+    (std::is_same_v<pixel_t, unsigned char>  ? 0.5f
+     : std::is_same_v<pixel_t, sycl::half> ? 1.0f / 16
+                                             : 0.0f) +
+    1.0f / 64;
+
+// A result as a pixel_t sample: rounded to nearest and clamped to
+// [0, 255] for bytes, converted for floating-point samples.
+pixel_t to_pixel(float value) {
+  if constexpr (std::is_same_v<pixel_t, unsigned char>) {
+    return static_cast<pixel_t>(
+        sycl::clamp(sycl::round(value), 0.0f, 255.0f));
+  } else {
+    return static_cast<pixel_t>(value);
+  }
+}
+
+sycl::vec<pixel_t, 4> to_pixel(sycl::float4 value) {
+  if constexpr (std::is_same_v<pixel_t, unsigned char>) {
+    return sycl::clamp(sycl::round(value), 0.0f, 255.0f).convert<pixel_t>();
+  } else {
+    return value.convert<pixel_t>();
+  }
+}
+
+// What a blur engine stores for a sample (float or float4) that blurs
+// to `blurred` and was `original`: the blur, or with unsharpMask the
+// original pushed away from it.
+template <typename T>
+T blur_result(T blurred, T original) {
+  if constexpr (unsharpMask) {
+    return original + unsharpAmount * (original - blurred);
+  } else {
+    return blurred;
+  }
+}
+
+// Pixels per work-item in the running-sum box blur; each work-item
+// pays filterWidth adds to seed its window, then two per pixel.
+inline constexpr int runningSumSegment = 64;
+
+// Rows (work-items) per work-group of the recursive Gaussian's
+// horizontal pass, and the pixels of those rows it stages in local
+// memory at a time (submit_gaussian_iir).
+inline constexpr std::array<int, 2> iirBlock = {16, 32};
+
+// Output pixels (rows, columns) one work-item of the median filter
+// walks.  A block builds its column histograms from filterWidth rows
+// before its first output, so blocks are made tall enough to amortize
+// that, and wide enough that moving down a row (which updates every
+// column histogram) is cheap per pixel.
+inline constexpr std::array<int, 2> medianBlock = {32, 32};
+
+// Device memory for the median filter's column histograms, per band.
+// Each of its work-items needs a set of them (about 38 KB at
+// filterWidth 44) and reuses it for block after block, so this bounds
+// how many run at once.
+inline constexpr size_t medianHistogramBytes = 32 << 20;
+
+// Output tile (rows, columns) one work-group of the tiled engine
+// computes.  GPUs get a square tile that fills a few sub-groups; on
+// the CPU device a work-group runs on one core, and a short wide tile
+// keeps the rows it reuses in L1/L2.  tile_shape() shrinks these to
+// whatever the device's local memory can hold.
+inline constexpr std::array<int, 2> gpuTile = {16, 16};
+inline constexpr std::array<int, 2> cpuTile = {8, 32};
+
+// Cost of the FFT engine per point of its padded grid and per radix-2
+// stage, in multiply-adds of the direct kernel: both transforms, each
+// stage a full pass over memory.  Sets the crossover in fft_pays_off().
+inline constexpr double fftWork = 8.0;
+
+// A filter that isn't separable can still run as a sum of a few
+// separable terms (the low-rank engine): at most lowRankMax of them,
+// and only if together they come within lowRankTolerance levels of the
+// filter on a full-contrast picture.
+inline constexpr int lowRankMax = 3;
+inline constexpr float lowRankTolerance = 1.0f;
+
+enum class blur_engine {
+  direct,
+  blocked,
+  tiled,
+  separable,
+  running_sum,
+  fft,
+  gaussian_iir,
+  sampled_image,
+  bilateral,
+  median,
+  morphology,
+  low_rank
+};
+
+const char* engine_name(blur_engine engine) {
+  switch (engine) {
+    case blur_engine::direct:
+      return "direct";
+    case blur_engine::blocked:
+      return "blocked";
+    case blur_engine::tiled:
+      return "tiled";
+    case blur_engine::separable:
+      return "separable";
+    case blur_engine::running_sum:
+      return "running sum";
+    case blur_engine::fft:
+      return "fft";
+    case blur_engine::gaussian_iir:
+      return "recursive gaussian";
+    case blur_engine::sampled_image:
+      return "sampled image";
+    case blur_engine::bilateral:
+      return "bilateral";
+    case blur_engine::median:
+      return "median";
+    case blur_engine::morphology:
+      return "morphology";
+    case blur_engine::low_rank:
+      return "low rank";
+  }
+  return "unknown";
+}
+
+// filterWidth, halo and channels of the direct, blocked, separable
+// and low-rank kernels, and of the tiled kernel's generic instance,
+// are specialization constants: the JIT builds one binary per shape
+// with them as literals, so trip counts are known and loops unroll.
+constexpr sycl::specialization_id<int> filterWidthConst{filterWidth};
+constexpr sycl::specialization_id<int> haloConst{halo};
+constexpr sycl::specialization_id<int> channelsConst{3};
+
+class conv2d_kernel;
+template <int StripHeight>
+class blocked_kernel;
+template <int Channels, int FilterWidth>
+class tiled_kernel;
+class low_rank_row_kernel;
+class low_rank_column_kernel;
+class row_pass_kernel;
+class row_shuffle_kernel;
+class row_rgba_kernel;
+class column_rgba_kernel;
+class column_pass_kernel;
+
+// Shape (and where) a specialized kernel bundle was built for.
+struct bundle_key {
+  sycl::context context;
+  sycl::device device;
+  int filterWidth;
+  int halo;
+  int channels;
+
+  bool operator==(const bundle_key& other) const {
+    return context == other.context && device == other.device &&
+           filterWidth == other.filterWidth && halo == other.halo &&
+           channels == other.channels;
+  }
+};
+
+struct bundle_key_hash {
+  size_t operator()(const bundle_key& key) const {
+    size_t h = std::hash<sycl::device>{}(key.device);
+    h = h * 31 + std::hash<sycl::context>{}(key.context);
+    h = h * 31 + key.filterWidth;
+    h = h * 31 + key.halo;
+    return h * 31 + key.channels;
+  }
+};
+
+// Executable bundle of KernelName with the specialization constants
+// set for this queue's device and shape.  Bundles are cached, so later
+// jobs of the same shape reuse the binary instead of JIT-ing again.
+template <typename KernelName>
+sycl::kernel_bundle<sycl::bundle_state::executable> specialized_bundle(
+    const sycl::queue& queue, int filterWidth, int halo, int channels) {
+  static std::unordered_map<bundle_key,
+                            sycl::kernel_bundle<sycl::bundle_state::executable>,
+                            bundle_key_hash>
+      cache;
+
+  bundle_key key{queue.get_context(), queue.get_device(), filterWidth, halo,
+                 channels};
+  auto found = cache.find(key);
+  if (found != cache.end()) return found->second;
+
+  sycl::kernel_bundle<sycl::bundle_state::input> input =
+      sycl::get_kernel_bundle<sycl::bundle_state::input>(
+          key.context, {key.device}, {sycl::get_kernel_id<KernelName>()});
+  input.set_specialization_constant<filterWidthConst>(filterWidth);
+  input.set_specialization_constant<haloConst>(halo);
+  input.set_specialization_constant<channelsConst>(channels);
+
+  return cache.emplace(key, sycl::build(input)).first->second;
+}
+
+//
+// The picture is cut into horizontal bands and each band is blurred
+// on its own queue.  A band_job owns everything one band needs on the
+// device: the input rows (plus `halo` padding rows above and below,
+// taken straight out of the padded image from read_image), the output
+// rows, which are copied back into the output image when the job is
+// destroyed, and any intermediates a multi-pass engine keeps on the
+// device between passes.  When the image was read without padding,
+// `source` holds just the picture rows the band needs and `in` is
+// filled from it on the device by submit_clamp_to_edge.
+//
+// For a planar image a job covers rows of a single channel plane,
+// which the kernels see as a one-channel image.
+struct band_job {
+  band_job(sycl::queue q, const util::image_ref<pixel_t>& inImage,
+           const util::image_ref<pixel_t>& outImage, int halo, int firstRow,
+           int height, int plane = 0)
+      : queue{q},
+        firstRow{firstRow},
+        height{height},
+        width{inImage.width()},
+        channels{inImage.layout() == util::image_layout::planar
+                     ? 1
+                     : inImage.channels()},
+        halo{halo},
+        in{sycl::range(height + (halo * 2), width + (halo * 2)) *
+           sycl::range(1, channels)},
+        out{sycl::range(height, width) * sycl::range(1, channels)} {
+    const pixel_t* inData = inImage.data();
+    if (inImage.halo() == halo) {
+      in = sycl::buffer<pixel_t, 2>{
+          inData + inImage.index(firstRow, 0, plane), in.get_range()};
+    } else {
+      assert(inImage.halo() == 0);
+      sourceFirstRow = std::max(0, firstRow - halo);
+      int sourceEnd = std::min(inImage.height(), firstRow + height + halo);
+      source.emplace(inData + inImage.index(sourceFirstRow, 0, plane),
+                     sycl::range(sourceEnd - sourceFirstRow, width) *
+                         sycl::range(1, channels));
+    }
+    out.set_final_data(outImage.data() + outImage.index(firstRow, 0, plane));
+  }
+
+  // `band` grown by `ring` pixels on every side, writing `widened`
+  // (height + 2 * ring rows of width + 2 * ring pixels).  It reads the
+  // band's padded input with that much less halo, so any engine run on
+  // it also produces the ring a neighbourhood kernel needs next.  It
+  // shares the band's source rows too, so an engine that pads the
+  // input for itself (the sampled-image fallback) can.
+  band_job(const band_job& band, int ring, sycl::buffer<pixel_t, 2> widened)
+      : queue{band.queue},
+        firstRow{band.firstRow - ring},
+        firstColumn{-ring},
+        height{band.height + ring * 2},
+        width{band.width + ring * 2},
+        channels{band.channels},
+        halo{band.halo - ring},
+        in{band.in},
+        out{widened},
+        source{band.source},
+        sourceFirstRow{band.sourceFirstRow} {}
+
+  sycl::queue queue;
+  int firstRow;
+  int firstColumn = 0;  // picture column of out's first pixel
+  int height;
+  int width;
+  int channels;
+  int halo;
+  sycl::buffer<pixel_t, 2> in;
+  sycl::buffer<pixel_t, 2> out;
+  std::optional<sycl::buffer<pixel_t, 2>> source;  // unpadded input rows
+  int sourceFirstRow = 0;                           // picture row of source[0]
+  std::optional<sycl::sampled_image<2>> image;  // input of the sampled-image
+                                                // engine
+  std::vector<sycl::buffer<float, 2>> scratch;  // device-only intermediates
+  std::vector<sycl::buffer<pixel_t, 2>> pictures;  // device-only pictures
+  std::vector<sycl::buffer<int, 2>> classes;    // Canny: latest first
+  std::optional<sycl::buffer<int, 1>> promotions;  // Canny: hysteresis count
+  std::optional<sycl::buffer<int, 2>> borders;  // Canny: neighbours' class rows
+  std::optional<sycl::buffer<std::uint16_t, 2>> histograms;  // median: column
+                                                           // histograms
+  std::vector<sycl::event> events;              // one per kernel submitted
+};
+
+// Fills the band's padded input from its unpadded source rows,
+// clamping coordinates to the picture's edges.  The source already
+// stops at the top and bottom of the picture and holds whole rows, so
+// clamping to it is clamping to the picture.  A widened job fills the
+// same input as its band.
+void submit_clamp_to_edge(band_job& job) {
+  auto channels = job.channels;
+  int firstRow = job.firstRow - job.halo - job.sourceFirstRow;
+  int firstColumn = job.firstColumn - job.halo;
+  int sourceRows = job.source->get_range()[0];
+  int sourceColumns = job.source->get_range()[1] / channels;
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor sourceAccessor{*job.source, cgh, sycl::read_only};
+    sycl::accessor inAccessor{job.in, cgh, sycl::write_only, sycl::no_init};
+
+    cgh.parallel_for(job.in.get_range(), [=](sycl::id<2> idx) {
+      int row = sycl::clamp(firstRow + static_cast<int>(idx[0]), 0,
+                            sourceRows - 1);
+      int x = sycl::clamp(firstColumn + static_cast<int>(idx[1] / channels),
+                          0, sourceColumns - 1);
+      inAccessor[idx] = sourceAccessor[row][x * channels + idx[1] % channels];
+    });
+  }));
+}
+
+// Direct 2D convolution: one work-item per output pixel, reading its
+// whole filterWidth x filterWidth neighbourhood.
+void submit_conv2d(band_job& job, sycl::buffer<float, 2>& filterBuf,
+                   int filterWidth, sycl::range<2> localRange) {
+  // Rows rounded up to whole work-groups; the extra work-items drop out.
+  auto height = job.height;
+  auto rows = (height + localRange[1] - 1) / localRange[1] * localRange[1];
+  auto ndRange = sycl::nd_range(sycl::range(job.width, rows), localRange);
+  auto bundle = specialized_bundle<conv2d_kernel>(job.queue, filterWidth,
+                                                  job.halo, job.channels);
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh1) {
+    sycl::accessor inAccessor{job.in, cgh1, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh1, sycl::write_only};
+    sycl::accessor filterAccessor{filterBuf, cgh1, sycl::read_only};
+    cgh1.use_kernel_bundle(bundle);
+
+    cgh1.parallel_for<conv2d_kernel>(ndRange, [=](sycl::nd_item<2> item,
+                                                  sycl::kernel_handler kh) {
+      int filterWidth = kh.get_specialization_constant<filterWidthConst>();
+      int halo = kh.get_specialization_constant<haloConst>();
+      int channels = kh.get_specialization_constant<channelsConst>();
+
+      auto globalId = item.get_global_id();
+      globalId = sycl::id{globalId[1], globalId[0]};
+      if (globalId[0] >= static_cast<size_t>(height)) return;
+
+      auto channelsStride = sycl::range(1, channels);
+      auto haloOffset = sycl::id(halo, halo);
+      auto src = (globalId + haloOffset) * channelsStride;
+      auto dest = globalId * channelsStride;
+
+      // 100 is a hack - so the dim is not dynamic
+      float sum[/* channels */ 100];
+      assert(channels < 100);
+
+      for (int i = 0; i < channels; ++i) {
+        sum[i] = 0.0f;
+      }
+
+      for (int r = 0; r < filterWidth; ++r) {
+        for (int c = 0; c < filterWidth; ++c) {
+          auto srcOffset =
+              sycl::id(src[0] + (r - halo), src[1] + ((c - halo) * channels));
+          auto filterOffset = sycl::id(r, c * channels);
+
+          for (int i = 0; i < channels; ++i) {
+            auto channelOffset = sycl::id(0, i);
+            sum[i] += inAccessor[srcOffset + channelOffset] *
+                      filterAccessor[filterOffset + channelOffset];
+          }
+        }
+      }
+
+      for (int i = 0; i < channels; ++i) {
+        float centre = inAccessor[src + sycl::id(0, i)];
+        outAccessor[dest + sycl::id(0, i)] =
+            to_pixel(blur_result(sum[i], centre));
+      }
+    });
+  }));
+}
+
+// Direct 2D convolution reading its input through a sampled image:
+// reads go through the texture cache, and the sampler's clamp_to_edge
+// addressing does the border handling, so the image holds only the
+// picture rows the band touches, unpadded.  Texels are float4, the
+// one format every device with images supports, so the rows are
+// widened on the host.  Devices without aspect::image get
+// submit_conv2d on the buffers instead.
+void submit_sampled_image(band_job& job,
+                          const util::image_ref<pixel_t>& inImage, int plane,
+                          sycl::buffer<float, 2>& filterBuf, int filterWidth,
+                          sycl::range<2> localRange) {
+  if (!job.queue.get_device().has(sycl::aspect::image)) {
+    if (job.source) submit_clamp_to_edge(job);
+    submit_conv2d(job, filterBuf, filterWidth, localRange);
+    return;
+  }
+
+  auto channels = job.channels;
+  auto halo = job.halo;
+  auto width = inImage.width();
+  int firstRow = std::max(0, job.firstRow - halo);
+  int rows = std::min(inImage.height(), job.firstRow + job.height + halo) -
+             firstRow;
+
+  auto texels = std::make_shared<std::vector<sycl::float4>>(
+      rows * width, sycl::float4{0.0f});
+  for (int y = 0; y < rows; ++y) {
+    for (int x = 0; x < width; ++x) {
+      for (int i = 0; i < channels; ++i) {
+        (*texels)[y * width + x][i] = inImage.data()[inImage.index(
+            firstRow + y + inImage.halo(), x + inImage.halo(), plane + i)];
+      }
+    }
+  }
+
+  std::shared_ptr<const void> hostData{texels, texels->data()};
+  job.image.emplace(
+      hostData, sycl::image_format::r32g32b32a32_sfloat,
+      sycl::image_sampler{sycl::addressing_mode::clamp_to_edge,
+                          sycl::coordinate_normalization_mode::unnormalized,
+                          sycl::filtering_mode::nearest},
+      sycl::range<2>(width, rows));
+
+  // Image row and column of the first tap of output pixel (0, 0).
+  int rowOffset = job.firstRow - halo - firstRow;
+  int columnOffset = job.firstColumn - halo;
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::sampled_image_accessor<sycl::float4, 2> imageAccessor{*job.image,
+                                                                cgh};
+    sycl::accessor filterAccessor{filterBuf, cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+
+    cgh.parallel_for(sycl::range(job.height, job.width), [=](sycl::id<2> idx) {
+      int y = idx[0] + rowOffset;
+      int x = idx[1] + columnOffset;
+      sycl::float4 sum{0.0f};
+      for (int r = 0; r < filterWidth; ++r) {
+        for (int c = 0; c < filterWidth; ++c) {
+          sycl::float4 weights{0.0f};
+          for (int i = 0; i < channels; ++i) {
+            weights[i] = filterAccessor[r][c * channels + i];
+          }
+          // Texel centres, in unnormalized coordinates.
+          sum += imageAccessor.read(sycl::float2(x + c + 0.5f, y + r + 0.5f)) *
+                 weights;
+        }
+      }
+      sum = blur_result(sum, imageAccessor.read(sycl::float2(
+                                 x + halo + 0.5f, y + halo + 0.5f)));
+      for (int i = 0; i < channels; ++i) {
+        outAccessor[idx[0]][idx[1] * channels + i] = to_pixel(sum[i]);
+      }
+    });
+  }));
+}
+
+// Direct 2D convolution with register blocking: each work-item
+// computes a vertical strip of StripHeight output pixels.  Every input
+// row the strip touches is read once and its samples are accumulated
+// into all the strip's outputs that use that row, so a strip loads
+// (StripHeight + filterWidth - 1) rows instead of StripHeight *
+// filterWidth.  Work-items are laid out like submit_conv2d's, with
+// the strip index in place of the row, and take the shape from the
+// same specialization constants.
+template <int StripHeight>
+void submit_blocked(band_job& job, sycl::buffer<float, 2>& filterBuf,
+                    int filterWidth, sycl::range<2> localRange) {
+  auto channels = job.channels;
+  auto halo = job.halo;
+  auto height = job.height;
+  int inRows = job.in.get_range()[0];
+  auto strips = (height + StripHeight - 1) / StripHeight;
+  strips = (strips + localRange[1] - 1) / localRange[1] * localRange[1];
+  auto ndRange = sycl::nd_range(sycl::range(job.width, strips), localRange);
+  auto bundle = specialized_bundle<blocked_kernel<StripHeight>>(
+      job.queue, filterWidth, halo, channels);
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+    sycl::accessor filterAccessor{filterBuf, cgh, sycl::read_only};
+    cgh.use_kernel_bundle(bundle);
+
+    cgh.parallel_for<blocked_kernel<StripHeight>>(
+        ndRange, [=](sycl::nd_item<2> item, sycl::kernel_handler kh) {
+          int filterWidth = kh.get_specialization_constant<filterWidthConst>();
+          int halo = kh.get_specialization_constant<haloConst>();
+          int channels = kh.get_specialization_constant<channelsConst>();
+          int x = item.get_global_id(0);
+          int y0 = item.get_global_id(1) * StripHeight;
+          if (y0 >= height) return;
+
+          for (int i = 0; i < channels; ++i) {
+            float sum[StripHeight] = {};
+
+            for (int r = 0; r < StripHeight + filterWidth - 1; ++r) {
+              // Rows past the band only feed outputs past the band.
+              int row = sycl::min(y0 + r, inRows - 1);
+              for (int c = 0; c < filterWidth; ++c) {
+                float value = inAccessor[row][(x + c) * channels + i];
+#pragma unroll
+                for (int s = 0; s < StripHeight; ++s) {
+                  int tap = r - s;
+                  if (tap >= 0 && tap < filterWidth) {
+                    sum[s] += value * filterAccessor[tap][c * channels + i];
+                  }
+                }
+              }
+            }
+
+#pragma unroll
+            for (int s = 0; s < StripHeight; ++s) {
+              if (y0 + s < height) {
+                float centre =
+                    inAccessor[y0 + s + halo][(x + halo) * channels + i];
+                outAccessor[y0 + s][x * channels + i] =
+                    to_pixel(blur_result(sum[s], centre));
+              }
+            }
+          }
+        });
+  }));
+}
+
+// The device's output tile, shrunk until the `bytes(rows, columns)`
+// of local memory it needs fit, and the tile fits one work-group.
+// Returns nothing when not even a single pixel fits.
+template <typename Bytes>
+std::optional<sycl::range<2>> fit_tile(const sycl::device& device,
+                                       Bytes bytes) {
+  auto tile = device.is_gpu() ? gpuTile : cpuTile;
+  auto localMem = device.get_info<sycl::info::device::local_mem_size>();
+  auto maxGroup = device.get_info<sycl::info::device::max_work_group_size>();
+
+  while (bytes(tile[0], tile[1]) > localMem ||
+         static_cast<size_t>(tile[0] * tile[1]) > maxGroup) {
+    if (tile[0] == 1 && tile[1] == 1) return std::nullopt;
+    if (tile[0] >= tile[1]) {
+      tile[0] = std::max(1, tile[0] / 2);
+    } else {
+      tile[1] = std::max(1, tile[1] / 2);
+    }
+  }
+
+  return sycl::range<2>(tile[0], tile[1]);
+}
+
+// Output tile for the tiled engine on `device`: the tile and its halo
+// have to fit in local memory.
+std::optional<sycl::range<2>> tile_shape(const sycl::device& device,
+                                         int filterWidth, int channels) {
+  return fit_tile(device, [&](int rows, int columns) {
+    return static_cast<size_t>(rows + filterWidth - 1) *
+           (columns + filterWidth - 1) * channels * sizeof(float);
+  });
+}
+
+// Direct 2D convolution out of local memory.  Each work-group first
+// loads its output tile plus the halo into a local_accessor, every
+// work-item taking its share of the loads, and after the barrier all
+// filterWidth * filterWidth taps are read from the tile instead of
+// from global memory.  Falls back to submit_conv2d when the tile
+// doesn't fit this band's device.
+//
+// With Channels and FilterWidth left at 0 the kernel works for any
+// shape, which it reads from specialization constants, so the JIT
+// still sees constant loop bounds.  Non-zero values build a variant
+// for that one shape, where the accumulators are a register array and
+// the tap loops unroll; submit_tiled_specialized() picks it when it
+// exists.
+template <int Channels = 0, int FilterWidth = 0>
+void submit_tiled(band_job& job, sycl::buffer<float, 2>& filterBuf,
+                  int filterWidth, sycl::range<2> localRange) {
+  auto tile = tile_shape(job.queue.get_device(), filterWidth, job.channels);
+  if (!tile) {
+    submit_conv2d(job, filterBuf, filterWidth, localRange);
+    return;
+  }
+
+  auto channels = job.channels;
+  auto width = job.width;
+  auto height = job.height;
+  int halo = filterWidth / 2;
+  int tileRows = (*tile)[0];
+  int tileColumns = (*tile)[1];
+  int haloRows = tileRows + filterWidth - 1;
+  int haloColumns = tileColumns + filterWidth - 1;
+  int inRows = job.in.get_range()[0];
+  int inColumns = job.in.get_range()[1] / channels;
+
+  // Round the band up to whole tiles; the extra work-items help load
+  // and then drop out.
+  auto globalRange =
+      sycl::range((height + tileRows - 1) / tileRows * tileRows,
+                  (width + tileColumns - 1) / tileColumns * tileColumns);
+  using kernel_name = tiled_kernel<Channels, FilterWidth>;
+  std::optional<sycl::kernel_bundle<sycl::bundle_state::executable>> bundle;
+  if constexpr (Channels == 0) {
+    bundle = specialized_bundle<kernel_name>(job.queue, filterWidth, halo,
+                                             channels);
+  }
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+    sycl::accessor filterAccessor{filterBuf, cgh, sycl::read_only};
+    sycl::local_accessor<float, 2> tileAccessor{
+        sycl::range(haloRows, haloColumns * channels), cgh};
+    if (bundle) cgh.use_kernel_bundle(*bundle);
+
+    cgh.parallel_for<kernel_name>(
+        sycl::nd_range(globalRange, *tile),
+        [=](sycl::nd_item<2> item, sycl::kernel_handler kh) {
+          int filterWidth = FilterWidth;
+          int halo = FilterWidth / 2;
+          int channels = Channels;
+          if constexpr (Channels == 0) {
+            filterWidth = kh.get_specialization_constant<filterWidthConst>();
+            halo = kh.get_specialization_constant<haloConst>();
+            channels = kh.get_specialization_constant<channelsConst>();
+          }
+          int y0 = item.get_group(0) * tileRows;
+          int x0 = item.get_group(1) * tileColumns;
+          int groupSize = tileRows * tileColumns;
+
+          for (int k = item.get_local_linear_id(); k < haloRows * haloColumns;
+               k += groupSize) {
+            int r = k / haloColumns;
+            int c = k % haloColumns;
+            int srcRow = sycl::min(y0 + r, inRows - 1);
+            int srcColumn = sycl::min(x0 + c, inColumns - 1);
+            for (int i = 0; i < channels; ++i) {
+              tileAccessor[r][c * channels + i] =
+                  inAccessor[srcRow][srcColumn * channels + i];
+            }
+          }
+
+          sycl::group_barrier(item.get_group());
+
+          int ly = item.get_local_id(0);
+          int lx = item.get_local_id(1);
+          if (y0 + ly >= height || x0 + lx >= width) return;
+
+          if constexpr (Channels > 0) {
+            float sum[Channels] = {};
+            // The row loop stays rolled so the 88-wide instances don't
+            // unroll into tens of thousands of instructions.
+            for (int r = 0; r < FilterWidth; ++r) {
+#pragma unroll
+              for (int c = 0; c < FilterWidth; ++c) {
+#pragma unroll
+                for (int i = 0; i < Channels; ++i) {
+                  sum[i] += tileAccessor[ly + r][(lx + c) * Channels + i] *
+                            filterAccessor[r][c * Channels + i];
+                }
+              }
+            }
+#pragma unroll
+            for (int i = 0; i < Channels; ++i) {
+              float centre =
+                  tileAccessor[ly + halo][(lx + halo) * Channels + i];
+              outAccessor[y0 + ly][(x0 + lx) * Channels + i] =
+                  to_pixel(blur_result(sum[i], centre));
+            }
+          } else {
+            for (int i = 0; i < channels; ++i) {
+              float sum = 0.0f;
+              for (int r = 0; r < filterWidth; ++r) {
+                for (int c = 0; c < filterWidth; ++c) {
+                  sum += tileAccessor[ly + r][(lx + c) * channels + i] *
+                         filterAccessor[r][c * channels + i];
+                }
+              }
+              float centre =
+                  tileAccessor[ly + halo][(lx + halo) * channels + i];
+              outAccessor[y0 + ly][(x0 + lx) * channels + i] =
+                  to_pixel(blur_result(sum, centre));
+            }
+          }
+        });
+  }));
+}
+
+// Filter widths the tiled engine has compile-time instances of, for
+// each of 1 to 4 channels.
+using specializedWidths = std::integer_sequence<int, 3, 5, 11, 22, 44, 88>;
+
+template <int Channels, int... Widths>
+void submit_tiled_for(band_job& job, sycl::buffer<float, 2>& filterBuf,
+                      int filterWidth, sycl::range<2> localRange,
+                      std::integer_sequence<int, Widths...>) {
+  bool found = ((filterWidth == Widths &&
+                 (submit_tiled<Channels, Widths>(job, filterBuf, filterWidth,
+                                                 localRange),
+                  true)) ||
+                ...);
+  if (!found) submit_tiled(job, filterBuf, filterWidth, localRange);
+}
+
+// Runs the compile-time instance of the tiled kernel matching this
+// band's channel count and filterWidth, or the generic one if there
+// is none.
+void submit_tiled_specialized(band_job& job, sycl::buffer<float, 2>& filterBuf,
+                              int filterWidth, sycl::range<2> localRange) {
+  switch (job.channels) {
+    case 1:
+      submit_tiled_for<1>(job, filterBuf, filterWidth, localRange,
+                          specializedWidths{});
+      break;
+    case 2:
+      submit_tiled_for<2>(job, filterBuf, filterWidth, localRange,
+                          specializedWidths{});
+      break;
+    case 3:
+      submit_tiled_for<3>(job, filterBuf, filterWidth, localRange,
+                          specializedWidths{});
+      break;
+    case 4:
+      submit_tiled_for<4>(job, filterBuf, filterWidth, localRange,
+                          specializedWidths{});
+      break;
+    default:
+      submit_tiled(job, filterBuf, filterWidth, localRange);
+      break;
+  }
+}
+
+// Gradient magnitude of a blurred band: `blurredBuf` holds the blur
+// of the band plus a one-pixel ring (height + 2 rows of width + 2
+// pixels), from which every output pixel takes its Sobel or Scharr
+// gradient, nine samples per channel.  Channel `keepChannel` (the
+// alpha of RGBA) is written blurred rather than differentiated.
+void submit_gradient(band_job& job, sycl::buffer<pixel_t, 2>& blurredBuf,
+                     edge_operator op, int keepChannel) {
+  auto channels = job.channels;
+
+  // Smoothing taps across the derivative, and their sum, so that a
+  // step of 255 has magnitude 255 with either operator.
+  float side = (op == edge_operator::scharr) ? 3.0f : 1.0f;
+  float middle = (op == edge_operator::scharr) ? 10.0f : 2.0f;
+  float norm = 2.0f * side + middle;
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor blurredAccessor{blurredBuf, cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+
+    cgh.parallel_for(sycl::range(job.height, job.width), [=](sycl::id<2> idx) {
+      int y = idx[0];
+      int x = idx[1];
+      for (int i = 0; i < channels; ++i) {
+        auto blurred = [&](int dy, int dx) -> float {
+          return blurredAccessor[y + 1 + dy][(x + 1 + dx) * channels + i];
+        };
+        float value;
+        if (i == keepChannel) {
+          value = blurred(0, 0);
+        } else {
+          float gx = side * (blurred(-1, 1) - blurred(-1, -1)) +
+                     middle * (blurred(0, 1) - blurred(0, -1)) +
+                     side * (blurred(1, 1) - blurred(1, -1));
+          float gy = side * (blurred(1, -1) - blurred(-1, -1)) +
+                     middle * (blurred(1, 0) - blurred(-1, 0)) +
+                     side * (blurred(1, 1) - blurred(-1, 1));
+          value = sycl::fmin(sycl::sqrt(gx * gx + gy * gy) / norm, 255.0f);
+        }
+        outAccessor[y][x * channels + i] = to_pixel(value);
+      }
+    });
+  }));
+}
+
+// The local tiles of a chain segment, stages [begin, end) of a chain.
+struct segment_shape {
+  int stencils = 0;
+  int padding = 0;       // used up by all the segment's stencils
+  int ring = 0;          // around the first stencil's output tile
+  bool rowPass = false;  // a blur runs as row and column passes
+};
+
+segment_shape chain_shape(const filter_chain& chain, int begin, int end,
+                          bool separable) {
+  segment_shape shape;
+  int firstPadding = -1;
+  for (int k = begin; k < end; ++k) {
+    const auto& stage = chain.stages[k];
+    shape.padding += stage.padding();
+    if (!stage.stencil()) continue;
+    ++shape.stencils;
+    if (firstPadding < 0) firstPadding = stage.padding();
+    if (stage.kind == stage_kind::blur && separable) shape.rowPass = true;
+  }
+  shape.ring = shape.padding - std::max(firstPadding, 0);
+  return shape;
+}
+
+// Output tile of a chain segment on `device`.  Its local memory is two
+// tiles grown by the ring to ping-pong between levels, when there is
+// more than one stencil, and the row-pass tile, which is as tall as
+// the segment's input.
+std::optional<sycl::range<2>> chain_tile(const sycl::device& device,
+                                         int channels,
+                                         const segment_shape& shape) {
+  return fit_tile(device, [&](int rows, int columns) {
+    size_t grown = static_cast<size_t>(columns + 2 * shape.ring);
+    size_t levels =
+        (shape.stencils > 1) ? 2 * (rows + 2 * shape.ring) * grown : 0;
+    size_t pass = shape.rowPass ? (rows + 2 * shape.padding) * grown : 0;
+    return (levels + pass) * channels * sizeof(float);
+  });
+}
+
+// Multiply-adds per output sample of stages [begin, end) in one kernel
+// with output tile `tile`.  Each stencil runs over its output grown by
+// the padding of the stencils after it, so a fused stencil also
+// computes a ring the neighbouring tiles compute again.
+double chain_cost(const filter_chain& chain, int begin, int end,
+                  bool separable, sycl::range<2> tile) {
+  int remaining = chain_shape(chain, begin, end, separable).padding;
+  double taps = 0.0;
+  for (int k = begin; k < end; ++k) {
+    const auto& stage = chain.stages[k];
+    int padding = stage.padding();
+    remaining -= padding;
+    if (!stage.stencil()) continue;
+    double rows = tile[0] + 2 * remaining;
+    double columns = tile[1] + 2 * remaining;
+    int width = 2 * padding + 1;
+    if (stage.kind == stage_kind::gradient) {
+      taps += rows * columns * 12;  // two 6-tap stencils
+    } else if (separable) {
+      taps += (2 * rows + 2 * padding) * columns * width;
+    } else {
+      taps += rows * columns * width * width;
+    }
+  }
+  return taps / (tile[0] * tile[1]);
+}
+
+// Stages [begin, end) of `chain` in one kernel, from `sourceBuf` (the
+// band's input, or an intermediate of an earlier segment) into
+// `destinationBuf`, which has `outPadding` rows and columns of padding
+// for the segments still to come.  The point-wise stages before the
+// first stencil are applied as the input tile is loaded, the ones
+// after a stencil as that stencil stores its result.  Every stencil
+// but the last writes a local tile that is larger than the output
+// tile by the padding the later stencils use up; the next one reads
+// it, so intermediates of the segment never leave local memory.  A
+// blur with 1D factors (`factors`) runs as a row pass, into a local
+// tile as tall as the blur's input, and a column pass; without them it
+// is a direct filterWidth^2 loop.  Channel `keepChannel` (the alpha of
+// RGBA) goes through unchanged.
+template <typename Source, typename Destination>
+void submit_chain_segment(band_job& job, sycl::buffer<Source, 2>& sourceBuf,
+                          sycl::buffer<Destination, 2>& destinationBuf,
+                          sycl::buffer<float, 2>& filterBuf, int filterWidth,
+                          const std::optional<util::separable_filter>& factors,
+                          const filter_chain& chain, int begin, int end,
+                          int keepChannel) {
+  auto device = job.queue.get_device();
+  auto channels = job.channels;
+  auto stages = chain.stages;
+  bool separable = factors.has_value();
+
+  auto shape = chain_shape(chain, begin, end, separable);
+  auto tile = chain_tile(device, channels, shape).value_or(sycl::range<2>(1, 1));
+  int segmentPadding = shape.padding;
+  int tileRows = tile[0];
+  int tileColumns = tile[1];
+  int levelRows = (shape.stencils > 1) ? tileRows + 2 * shape.ring : 1;
+  int levelColumns = (shape.stencils > 1) ? tileColumns + 2 * shape.ring : 1;
+  int passRows = shape.rowPass ? tileRows + 2 * segmentPadding : 1;
+  int passColumns = shape.rowPass ? tileColumns + 2 * shape.ring : 1;
+  int haloRows = tileRows + 2 * segmentPadding;
+  int haloColumns = tileColumns + 2 * segmentPadding;
+  int inRows = sourceBuf.get_range()[0];
+  int inColumns = sourceBuf.get_range()[1] / channels;
+  int outRows = destinationBuf.get_range()[0];
+  int outColumns = destinationBuf.get_range()[1] / channels;
+
+  auto localMem = device.get_info<sycl::info::device::local_mem_size>();
+  bool inputInLocal =
+      static_cast<size_t>(haloRows * haloColumns +
+                          2 * levelRows * levelColumns +
+                          passRows * passColumns) *
+          channels * sizeof(float) <=
+      localMem;
+
+  // The factors' taps; the filter stands in, unread, without them.
+  auto rowBuf = separable ? job.scratch.emplace_back(
+                                factors->row.data(),
+                                sycl::range<2>(1, factors->row.size()))
+                          : filterBuf;
+  auto columnBuf = separable ? job.scratch.emplace_back(
+                                   factors->column.data(),
+                                   sycl::range<2>(1, factors->column.size()))
+                             : filterBuf;
+
+  auto globalRange =
+      sycl::range((outRows + tileRows - 1) / tileRows * tileRows,
+                  (outColumns + tileColumns - 1) / tileColumns * tileColumns);
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{sourceBuf, cgh, sycl::read_only};
+    sycl::accessor outAccessor{destinationBuf, cgh, sycl::write_only,
+                               sycl::no_init};
+    sycl::accessor filterAccessor{filterBuf, cgh, sycl::read_only};
+    sycl::accessor rowAccessor{rowBuf, cgh, sycl::read_only};
+    sycl::accessor columnAccessor{columnBuf, cgh, sycl::read_only};
+    sycl::local_accessor<float, 2> tileAccessor{
+        inputInLocal ? sycl::range(haloRows, haloColumns * channels)
+                     : sycl::range(1, 1),
+        cgh};
+    sycl::local_accessor<float, 2> evenAccessor{
+        sycl::range(levelRows, levelColumns * channels), cgh};
+    sycl::local_accessor<float, 2> oddAccessor{
+        sycl::range(levelRows, levelColumns * channels), cgh};
+    sycl::local_accessor<float, 2> passAccessor{
+        sycl::range(passRows, passColumns * channels), cgh};
+
+    cgh.parallel_for(
+        sycl::nd_range(globalRange, tile), [=](sycl::nd_item<2> item) {
+          int y0 = item.get_group(0) * tileRows;
+          int x0 = item.get_group(1) * tileColumns;
+          int groupSize = tileRows * tileColumns;
+          int ly = item.get_local_id(0);
+          int lx = item.get_local_id(1);
+
+          // The point-wise stages in [from, to) on one pixel.
+          auto pointwise = [&](float* value, int from, int to) {
+            for (int k = from; k < to; ++k) {
+              const auto& stage = stages[k];
+              if (stage.kind == stage_kind::grayscale && channels >= 3) {
+                float luma = 0.299f * value[0] + 0.587f * value[1] +
+                             0.114f * value[2];
+                value[0] = value[1] = value[2] = luma;
+              }
+              for (int i = 0; i < channels; ++i) {
+                if (i == keepChannel) continue;
+                if (stage.kind == stage_kind::threshold) {
+                  value[i] = (value[i] >= stage.level) ? 255.0f : 0.0f;
+                } else if (stage.kind == stage_kind::scale) {
+                  value[i] = value[i] * stage.factor + stage.offset;
+                }
+              }
+            }
+          };
+          int leading = begin;
+          while (leading < end && !stages[leading].stencil()) ++leading;
+
+          // Source pixel (r, c) counted from the group's corner, with
+          // the leading point-wise stages applied.
+          auto load = [&](int r, int c, float* value) {
+            int row = sycl::min(y0 + r, inRows - 1);
+            int column = sycl::min(x0 + c, inColumns - 1);
+            for (int i = 0; i < channels; ++i) {
+              value[i] = inAccessor[row][column * channels + i];
+            }
+            pointwise(value, begin, leading);
+          };
+          auto input = [&](int r, int c, int i) -> float {
+            if (inputInLocal) return tileAccessor[r][c * channels + i];
+            float value[4];
+            load(r, c, value);
+            return value[i];
+          };
+
+          if (inputInLocal) {
+            for (int k = item.get_local_linear_id(); k < haloRows * haloColumns;
+                 k += groupSize) {
+              int r = k / haloColumns;
+              int c = k % haloColumns;
+              float value[4];
+              load(r, c, value);
+              for (int i = 0; i < channels; ++i) {
+                tileAccessor[r][c * channels + i] = value[i];
+              }
+            }
+            sycl::group_barrier(item.get_group());
+          }
+
+          auto store = [&](int y, int x, const float* value) {
+            if (y >= outRows || x >= outColumns) return;
+            for (int i = 0; i < channels; ++i) {
+              if constexpr (std::is_same_v<Destination, float>) {
+                outAccessor[y][x * channels + i] = value[i];
+              } else {
+                outAccessor[y][x * channels + i] = to_pixel(value[i]);
+              }
+            }
+          };
+
+          // Point-wise only: nothing to share.
+          if (leading == end) {
+            float value[4];
+            for (int i = 0; i < channels; ++i) {
+              value[i] = input(ly + segmentPadding, lx + segmentPadding, i);
+            }
+            store(y0 + ly, x0 + lx, value);
+            return;
+          }
+
+          int level = 0;
+          int remaining = segmentPadding;
+          for (int k = leading; k < end; ++level) {
+            const auto& stage = stages[k];
+            int next = k + 1;
+            while (next < end && !stages[next].stencil()) ++next;
+            int padding = stage.padding();
+            remaining -= padding;
+
+            // Sample (r, c) of this stencil's input, from the corner of
+            // the region it reads.
+            auto sample = [&](int r, int c, int i) -> float {
+              if (level == 0) return input(r, c, i);
+              return (level % 2) ? evenAccessor[r][c * channels + i]
+                                 : oddAccessor[r][c * channels + i];
+            };
+            int rows = tileRows + 2 * remaining;
+            int columns = tileColumns + 2 * remaining;
+
+            // A separable blur's row pass, over every row of its input.
+            bool rowPass = separable && stage.kind == stage_kind::blur;
+            if (rowPass) {
+              int inputRows = rows + 2 * padding;
+              for (int e = item.get_local_linear_id(); e < inputRows * columns;
+                   e += groupSize) {
+                int r = e / columns;
+                int c = e % columns;
+                for (int i = 0; i < channels; ++i) {
+                  float sum = 0.0f;
+                  for (int fc = 0; fc < filterWidth; ++fc) {
+                    sum += sample(r, c + fc, i) *
+                           rowAccessor[0][fc * channels + i];
+                  }
+                  passAccessor[r][c * channels + i] = sum;
+                }
+              }
+              sycl::group_barrier(item.get_group());
+            }
+
+            // Output (r, c) of this stencil plus the point-wise stages
+            // up to the next one.
+            auto compute = [&](int r, int c, float* value) {
+              float side = (stage.op == edge_operator::scharr) ? 3.0f : 1.0f;
+              float middle =
+                  (stage.op == edge_operator::scharr) ? 10.0f : 2.0f;
+              for (int i = 0; i < channels; ++i) {
+                if (i == keepChannel) {
+                  value[i] = sample(r + padding, c + padding, i);
+                } else if (rowPass) {
+                  float sum = 0.0f;
+                  for (int fr = 0; fr < filterWidth; ++fr) {
+                    sum += passAccessor[r + fr][c * channels + i] *
+                           columnAccessor[0][fr * channels + i];
+                  }
+                  value[i] = sum;
+                } else if (stage.kind == stage_kind::blur) {
+                  float sum = 0.0f;
+                  for (int fr = 0; fr < filterWidth; ++fr) {
+                    for (int fc = 0; fc < filterWidth; ++fc) {
+                      sum += sample(r + fr, c + fc, i) *
+                             filterAccessor[fr][fc * channels + i];
+                    }
+                  }
+                  value[i] = sum;
+                } else {
+                  auto at = [&](int dy, int dx) {
+                    return sample(r + 1 + dy, c + 1 + dx, i);
+                  };
+                  float gx = side * (at(-1, 1) - at(-1, -1)) +
+                             middle * (at(0, 1) - at(0, -1)) +
+                             side * (at(1, 1) - at(1, -1));
+                  float gy = side * (at(1, -1) - at(-1, -1)) +
+                             middle * (at(1, 0) - at(-1, 0)) +
+                             side * (at(1, 1) - at(-1, 1));
+                  value[i] = sycl::fmin(
+                      sycl::sqrt(gx * gx + gy * gy) / (2.0f * side + middle),
+                      255.0f);
+                }
+              }
+              pointwise(value, k + 1, next);
+            };
+
+            if (next == end) {
+              float value[4];
+              compute(ly, lx, value);
+              store(y0 + ly, x0 + lx, value);
+            } else {
+              for (int e = item.get_local_linear_id(); e < rows * columns;
+                   e += groupSize) {
+                int r = e / columns;
+                int c = e % columns;
+                float value[4];
+                compute(r, c, value);
+                for (int i = 0; i < channels; ++i) {
+                  if (level % 2) {
+                    oddAccessor[r][c * channels + i] = value[i];
+                  } else {
+                    evenAccessor[r][c * channels + i] = value[i];
+                  }
+                }
+              }
+              sycl::group_barrier(item.get_group());
+            }
+            k = next;
+          }
+        });
+  }));
+}
+
+// Where the kernels of `chain` start on `device`, plus chain.size at
+// the end, for a blur that is `separable` or not.  A stencil joins the
+// current kernel while its local tiles still fit at the device's full
+// tile shape and the kernel's wider ring costs less than
+// chainSplitTaps more per sample.  Leading point-wise stages go with
+// the first stencil, the others with the stencil before them.
+std::vector<int> chain_segments(const sycl::device& device, int channels,
+                                const filter_chain& chain, bool separable) {
+  auto fullTile = device.is_gpu() ? gpuTile : cpuTile;
+  std::vector<int> starts{0};
+  int start = 0;
+  bool hasStencil = false;
+  for (int k = 0; k < chain.size; ++k) {
+    if (!chain.stages[k].stencil()) continue;
+    if (hasStencil) {
+      auto tile = chain_tile(device, channels,
+                             chain_shape(chain, start, k + 1, separable));
+      if (tile && static_cast<int>((*tile)[0]) == fullTile[0] &&
+          static_cast<int>((*tile)[1]) == fullTile[1] &&
+          chain_cost(chain, start, k + 1, separable, *tile) <=
+              chain_cost(chain, start, k, separable, *tile) +
+                  chain_cost(chain, k, k + 1, separable, *tile) +
+                  chainSplitTaps) {
+        continue;
+      }
+      starts.push_back(k);
+      start = k;
+    }
+    hasStencil = true;
+  }
+  starts.push_back(chain.size);
+  return starts;
+}
+
+const char* stage_name(stage_kind kind) {
+  switch (kind) {
+    case stage_kind::blur:
+      return "blur";
+    case stage_kind::gradient:
+      return "gradient";
+    case stage_kind::threshold:
+      return "threshold";
+    case stage_kind::grayscale:
+      return "grayscale";
+    case stage_kind::scale:
+      return "scale";
+  }
+  return "unknown";
+}
+
+// Runs `chain` on a band in the kernels chain_segments plans; a
+// stencil that starts a new kernel reads the previous one's output
+// from a float intermediate in global memory, padded for the stencils
+// still to come.
+void submit_chain(band_job& job, sycl::buffer<float, 2>& filterBuf,
+                  int filterWidth,
+                  const std::optional<util::separable_filter>& factors,
+                  const filter_chain& chain, int keepChannel) {
+  assert(job.halo == chain.padding());
+  auto starts = chain_segments(job.queue.get_device(), job.channels, chain,
+                               factors.has_value());
+
+  int remaining = chain.padding();
+  std::optional<sycl::buffer<float, 2>> previous;
+  for (std::size_t s = 0; s + 1 < starts.size(); ++s) {
+    int begin = starts[s];
+    int end = starts[s + 1];
+    for (int k = begin; k < end; ++k) remaining -= chain.stages[k].padding();
+
+    if (s + 2 == starts.size()) {
+      if (previous) {
+        submit_chain_segment(job, *previous, job.out, filterBuf, filterWidth,
+                             factors, chain, begin, end, keepChannel);
+      } else {
+        submit_chain_segment(job, job.in, job.out, filterBuf, filterWidth,
+                             factors, chain, begin, end, keepChannel);
+      }
+      break;
+    }
+
+    // A handle, not a reference: the segment adds to job.scratch.
+    auto intermediate = job.scratch.emplace_back(
+        sycl::range(job.height + 2 * remaining, job.width + 2 * remaining) *
+        sycl::range(1, job.channels));
+    if (previous) {
+      submit_chain_segment(job, *previous, intermediate, filterBuf,
+                           filterWidth, factors, chain, begin, end,
+                           keepChannel);
+    } else {
+      submit_chain_segment(job, job.in, intermediate, filterBuf, filterWidth,
+                           factors, chain, begin, end, keepChannel);
+    }
+    previous = intermediate;
+  }
+}
+
+// Horizontal pass of a separable filter built on sub-group shuffles.
+// Each lane of a sub-group owns one sample of the row; per block of
+// `lanes` samples a lane does one global load, and the tap window is
+// assembled from its neighbours' registers with select_from_group:
+// for an offset of d samples a lane takes the current block from lane
+// (lane + d) if that's still inside the sub-group and the next block
+// from the wrapped-around lane otherwise.  Work-groups are one row
+// wide, so a sub-group is a contiguous run of samples; the run at the
+// end of a row is padded out with lanes that load clamped samples,
+// take part in the shuffles and write nothing.
+void submit_row_shuffle(band_job& job, sycl::buffer<float, 2>& rowBuf,
+                        sycl::buffer<float, 2>& tmpBuf, int filterWidth) {
+  constexpr int groupWidth = 64;
+  auto bundle = specialized_bundle<row_shuffle_kernel>(
+      job.queue, filterWidth, job.halo, job.channels);
+  int rowLength = tmpBuf.get_range()[1];
+  int paddedRowLength = job.in.get_range()[1];
+  auto globalRange = sycl::range(
+      tmpBuf.get_range()[0],
+      (rowLength + groupWidth - 1) / groupWidth * groupWidth);
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor rowAccessor{rowBuf, cgh, sycl::read_only};
+    sycl::accessor tmpAccessor{tmpBuf, cgh, sycl::write_only, sycl::no_init};
+    cgh.use_kernel_bundle(bundle);
+
+    cgh.parallel_for<row_shuffle_kernel>(
+        sycl::nd_range(globalRange, sycl::range(1, groupWidth)),
+        [=](sycl::nd_item<2> item, sycl::kernel_handler kh) {
+          int filterWidth = kh.get_specialization_constant<filterWidthConst>();
+          int channels = kh.get_specialization_constant<channelsConst>();
+          auto sg = item.get_sub_group();
+          int lanes = sg.get_local_range()[0];
+          int lane = sg.get_local_id()[0];
+          int row = item.get_global_id(0);
+          int q = item.get_global_id(1);
+          int i = q % channels;
+          int span = (filterWidth - 1) * channels;  // offset of the last tap
+
+          auto load = [&](int block) {
+            return inAccessor[row][sycl::min(q + block * lanes,
+                                             paddedRowLength - 1)];
+          };
+
+          float sum = 0.0f;
+          float next = load(0);
+          for (int block = 0; block * lanes <= span; ++block) {
+            float current = next;
+            next = load(block + 1);
+            // offset is the same in every lane, so the branches below
+            // never split the sub-group.
+            for (int d = 0; d < lanes; ++d) {
+              int offset = block * lanes + d;
+              if (offset > span) break;
+              if (offset % channels != 0) continue;
+              int src = (lane + d) % lanes;
+              float low = sycl::select_from_group(sg, current, src);
+              float high = sycl::select_from_group(sg, next, src);
+              sum += (lane + d < lanes ? low : high) *
+                     rowAccessor[0][offset + i];
+            }
+          }
+
+          if (q < rowLength) tmpAccessor[row][q] = sum;
+        });
+  }));
+}
+
+// Both passes of the separable engine for 4-channel images.  The
+// interleaved RGBA buffers are reinterpreted as sycl::float4, so every
+// load and store moves a whole pixel and the multiply-adds run on full
+// vectors: wide loads on GPUs, SIMD lanes on the CPU device.
+void submit_separable_rgba(band_job& job, sycl::buffer<float, 2>& rowBuf,
+                           sycl::buffer<float, 2>& columnBuf,
+                           sycl::buffer<float, 2>& tmpBuf, int filterWidth) {
+  auto pixels = [](auto& buf) {
+    using T = typename std::decay_t<decltype(buf)>::value_type;
+    auto range = buf.get_range();
+    return buf.template reinterpret<sycl::vec<T, 4>, 2>(
+        sycl::range(range[0], range[1] / 4));
+  };
+  auto in4 = pixels(job.in);
+  auto out4 = pixels(job.out);
+  auto tmp4 = pixels(tmpBuf);
+  auto row4 = pixels(rowBuf);
+  auto column4 = pixels(columnBuf);
+
+  auto rowBundle = specialized_bundle<row_rgba_kernel>(
+      job.queue, filterWidth, job.halo, job.channels);
+  auto columnBundle = specialized_bundle<column_rgba_kernel>(
+      job.queue, filterWidth, job.halo, job.channels);
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{in4, cgh, sycl::read_only};
+    sycl::accessor rowAccessor{row4, cgh, sycl::read_only};
+    sycl::accessor tmpAccessor{tmp4, cgh, sycl::write_only, sycl::no_init};
+    cgh.use_kernel_bundle(rowBundle);
+
+    cgh.parallel_for<row_rgba_kernel>(
+        tmp4.get_range(), [=](sycl::item<2> item, sycl::kernel_handler kh) {
+          int filterWidth = kh.get_specialization_constant<filterWidthConst>();
+          auto idx = item.get_id();
+          sycl::float4 sum{0.0f};
+          for (int c = 0; c < filterWidth; ++c) {
+            sum += inAccessor[idx[0]][idx[1] + c].convert<float>() *
+                   rowAccessor[0][c];
+          }
+          tmpAccessor[idx] = sum;
+        });
+  }));
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{in4, cgh, sycl::read_only};
+    sycl::accessor tmpAccessor{tmp4, cgh, sycl::read_only};
+    sycl::accessor columnAccessor{column4, cgh, sycl::read_only};
+    sycl::accessor outAccessor{out4, cgh, sycl::write_only};
+    cgh.use_kernel_bundle(columnBundle);
+
+    cgh.parallel_for<column_rgba_kernel>(
+        out4.get_range(), [=](sycl::item<2> item, sycl::kernel_handler kh) {
+          int filterWidth = kh.get_specialization_constant<filterWidthConst>();
+          int halo = kh.get_specialization_constant<haloConst>();
+          auto idx = item.get_id();
+          sycl::float4 sum{0.0f};
+          for (int r = 0; r < filterWidth; ++r) {
+            sum += tmpAccessor[idx[0] + r][idx[1]] * columnAccessor[0][r];
+          }
+          auto centre =
+              inAccessor[idx[0] + halo][idx[1] + halo].convert<float>();
+          outAccessor[idx] = to_pixel(blur_result(sum, centre));
+        });
+  }));
+}
+
+// Two-pass convolution for a separable filter.  The horizontal pass
+// runs over every padded row of the band so that the vertical pass
+// finds its halo rows in the intermediate, which never leaves the
+// device.  Each work-item handles one channel of one pixel, except for
+// RGBA images (submit_separable_rgba) and in the horizontal pass with
+// subGroupRows (submit_row_shuffle).
+void submit_separable(band_job& job, const util::separable_filter& filter,
+                      bool subGroupRows) {
+  auto halo = job.halo;
+  auto rowLength = job.width * job.channels;
+  auto filterWidth = static_cast<int>(filter.row.size()) / job.channels;
+  auto columnBundle = specialized_bundle<column_pass_kernel>(
+      job.queue, filterWidth, halo, job.channels);
+
+  auto rowBuf = job.scratch.emplace_back(
+      filter.row.data(), sycl::range<2>(1, filter.row.size()));
+  auto columnBuf = job.scratch.emplace_back(
+      filter.column.data(), sycl::range<2>(1, filter.column.size()));
+  auto tmpBuf = job.scratch.emplace_back(
+      sycl::range(job.height + (halo * 2), rowLength));
+
+  if (job.channels == 4) {
+    submit_separable_rgba(job, rowBuf, columnBuf, tmpBuf, filterWidth);
+    return;
+  }
+
+  if (subGroupRows) {
+    submit_row_shuffle(job, rowBuf, tmpBuf, filterWidth);
+  } else {
+    auto rowBundle = specialized_bundle<row_pass_kernel>(
+        job.queue, filterWidth, halo, job.channels);
+
+    job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+      sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+      sycl::accessor rowAccessor{rowBuf, cgh, sycl::read_only};
+      sycl::accessor tmpAccessor{tmpBuf, cgh, sycl::write_only,
+                                 sycl::no_init};
+      cgh.use_kernel_bundle(rowBundle);
+
+      cgh.parallel_for<row_pass_kernel>(
+          tmpBuf.get_range(),
+          [=](sycl::item<2> item, sycl::kernel_handler kh) {
+            int filterWidth =
+                kh.get_specialization_constant<filterWidthConst>();
+            int channels = kh.get_specialization_constant<channelsConst>();
+            auto idx = item.get_id();
+            auto i = idx[1] % channels;
+            float sum = 0.0f;
+            for (int c = 0; c < filterWidth; ++c) {
+              sum += inAccessor[idx[0]][idx[1] + c * channels] *
+                     rowAccessor[0][c * channels + i];
+            }
+            tmpAccessor[idx] = sum;
+          });
+    }));
+  }
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor tmpAccessor{tmpBuf, cgh, sycl::read_only};
+    sycl::accessor columnAccessor{columnBuf, cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+    cgh.use_kernel_bundle(columnBundle);
+
+    cgh.parallel_for<column_pass_kernel>(
+        job.out.get_range(), [=](sycl::item<2> item, sycl::kernel_handler kh) {
+          int filterWidth = kh.get_specialization_constant<filterWidthConst>();
+          int halo = kh.get_specialization_constant<haloConst>();
+          int channels = kh.get_specialization_constant<channelsConst>();
+          auto idx = item.get_id();
+          auto i = idx[1] % channels;
+          float sum = 0.0f;
+          for (int r = 0; r < filterWidth; ++r) {
+            sum += tmpAccessor[idx[0] + r][idx[1]] *
+                   columnAccessor[0][r * channels + i];
+          }
+          float centre = inAccessor[idx[0] + halo][idx[1] + halo * channels];
+          outAccessor[idx] = to_pixel(blur_result(sum, centre));
+        });
+  }));
+}
+
+// Low-rank engine: a filter that is close to a sum of a few separable
+// terms (util::low_rank_filter) gets one horizontal pass per term, all
+// in one kernel writing a stack of intermediates, then a single
+// vertical pass that applies every term's column factor and adds them
+// up, so the output is written once.  That is 2 * terms * filterWidth
+// multiply-adds per sample instead of filterWidth^2.  Both kernels take
+// the shape from specialization constants; the rank stays a runtime
+// trip count.
+void submit_low_rank(band_job& job, const util::separable_filter& terms,
+                     int filterWidth) {
+  auto halo = job.halo;
+  auto channels = job.channels;
+  auto rowLength = job.width * job.channels;
+  int paddedHeight = job.height + (halo * 2);
+  int termSize = filterWidth * channels;
+  int rank = static_cast<int>(terms.row.size()) / termSize;
+
+  // The plan the terms belong to outlives the job.
+  auto rowBuf = job.scratch.emplace_back(terms.row.data(),
+                                         sycl::range(rank, termSize));
+  auto columnBuf = job.scratch.emplace_back(terms.column.data(),
+                                            sycl::range(rank, termSize));
+  auto tmpBuf =
+      job.scratch.emplace_back(sycl::range(rank * paddedHeight, rowLength));
+  auto rowBundle = specialized_bundle<low_rank_row_kernel>(
+      job.queue, filterWidth, halo, channels);
+  auto columnBundle = specialized_bundle<low_rank_column_kernel>(
+      job.queue, filterWidth, halo, channels);
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor rowAccessor{rowBuf, cgh, sycl::read_only};
+    sycl::accessor tmpAccessor{tmpBuf, cgh, sycl::write_only, sycl::no_init};
+    cgh.use_kernel_bundle(rowBundle);
+
+    cgh.parallel_for<low_rank_row_kernel>(
+        tmpBuf.get_range(), [=](sycl::item<2> item, sycl::kernel_handler kh) {
+          int filterWidth = kh.get_specialization_constant<filterWidthConst>();
+          int channels = kh.get_specialization_constant<channelsConst>();
+          int term = item[0] / paddedHeight;
+          int row = item[0] % paddedHeight;
+          int q = item[1];
+          int i = q % channels;
+          float sum = 0.0f;
+          for (int c = 0; c < filterWidth; ++c) {
+            sum += inAccessor[row][q + c * channels] *
+                   rowAccessor[term][c * channels + i];
+          }
+          tmpAccessor[item.get_id()] = sum;
+        });
+  }));
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor tmpAccessor{tmpBuf, cgh, sycl::read_only};
+    sycl::accessor columnAccessor{columnBuf, cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+    cgh.use_kernel_bundle(columnBundle);
+
+    cgh.parallel_for<low_rank_column_kernel>(
+        job.out.get_range(), [=](sycl::item<2> item, sycl::kernel_handler kh) {
+          int filterWidth = kh.get_specialization_constant<filterWidthConst>();
+          int halo = kh.get_specialization_constant<haloConst>();
+          int channels = kh.get_specialization_constant<channelsConst>();
+          int y = item[0];
+          int q = item[1];
+          int i = q % channels;
+          float sum = 0.0f;
+          for (int term = 0; term < rank; ++term) {
+            for (int r = 0; r < filterWidth; ++r) {
+              sum += tmpAccessor[term * paddedHeight + y + r][q] *
+                     columnAccessor[term][r * channels + i];
+            }
+          }
+          float centre = inAccessor[y + halo][q + halo * channels];
+          outAccessor[item.get_id()] = to_pixel(blur_result(sum, centre));
+        });
+  }));
+}
+
+// Box filter via running sums: the horizontal pass keeps a sliding
+// window sum along each row, the vertical pass slides down each
+// column and scales by the per-channel box weight, so the cost per
+// pixel does not depend on filterWidth.  To keep a device busy every
+// row (and every column) is cut into segments of runningSumSegment
+// pixels; a work-item seeds the window once for its segment and then
+// only adds the entering and subtracts the leaving sample.  With 8-bit
+// inputs the sums are whole numbers well inside float's 24-bit
+// mantissa, so sliding introduces no drift.
+void submit_running_sum(band_job& job, const std::vector<float>& weights,
+                        int filterWidth) {
+  auto channels = job.channels;
+  auto halo = job.halo;
+  auto width = job.width;
+  auto height = job.height;
+  auto paddedHeight = height + (halo * 2);
+  auto segment = runningSumSegment;
+  auto rowSegments = (width + segment - 1) / segment;
+  auto columnSegments = (height + segment - 1) / segment;
+
+  auto weightBuf = job.scratch.emplace_back(
+      weights.data(), sycl::range<2>(1, weights.size()));
+  auto tmpBuf = job.scratch.emplace_back(
+      sycl::range(paddedHeight, width) * sycl::range(1, channels));
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor tmpAccessor{tmpBuf, cgh, sycl::write_only, sycl::no_init};
+
+    cgh.parallel_for(
+        sycl::range(paddedHeight, rowSegments * channels),
+        [=](sycl::id<2> idx) {
+          auto row = idx[0];
+          auto i = idx[1] % channels;
+          int x0 = (idx[1] / channels) * segment;
+          int x1 = sycl::min(x0 + segment, width);
+
+          float sum = 0.0f;
+          for (int c = 0; c < filterWidth; ++c) {
+            sum += inAccessor[row][(x0 + c) * channels + i];
+          }
+          tmpAccessor[row][x0 * channels + i] = sum;
+
+          for (int x = x0 + 1; x < x1; ++x) {
+            sum += inAccessor[row][(x + filterWidth - 1) * channels + i] -
+                   inAccessor[row][(x - 1) * channels + i];
+            tmpAccessor[row][x * channels + i] = sum;
+          }
+        });
+  }));
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor tmpAccessor{tmpBuf, cgh, sycl::read_only};
+    sycl::accessor weightAccessor{weightBuf, cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+
+    cgh.parallel_for(
+        sycl::range(columnSegments, width * channels), [=](sycl::id<2> idx) {
+          auto column = idx[1];
+          auto weight = weightAccessor[0][column % channels];
+          int y0 = idx[0] * segment;
+          int y1 = sycl::min(y0 + segment, height);
+
+          auto centre = [&](int y) -> float {
+            return inAccessor[y + halo][column + halo * channels];
+          };
+
+          float sum = 0.0f;
+          for (int r = 0; r < filterWidth; ++r) {
+            sum += tmpAccessor[y0 + r][column];
+          }
+          outAccessor[y0][column] =
+              to_pixel(blur_result(sum * weight, centre(y0)));
+
+          for (int y = y0 + 1; y < y1; ++y) {
+            sum += tmpAccessor[y + filterWidth - 1][column] -
+                   tmpAccessor[y - 1][column];
+            outAccessor[y][column] =
+                to_pixel(blur_result(sum * weight, centre(y)));
+          }
+        });
+  }));
+}
+
+// Smallest power of two that is at least n.
+int fft_size(int n) {
+  int size = 1;
+  while (size < n) size *= 2;
+  return size;
+}
+
+// Whether the FFT engine should beat kernels doing `taps`
+// multiply-adds per pixel (filterWidth^2 for the direct ones) on a
+// width x height image: the FFT does fftWork per grid point and stage,
+// spread over the pixels.  Separable filters never get here, their two
+// 1D passes always win.
+bool fft_pays_off(int width, int height, int filterWidth, double taps = 0.0) {
+  if (taps <= 0.0) taps = static_cast<double>(filterWidth) * filterWidth;
+  double points = static_cast<double>(fft_size(width + filterWidth)) *
+                  fft_size(height + filterWidth);
+  double fftCost = fftWork * points * std::log2(points) /
+                   (static_cast<double>(width) * height);
+  return fftCost < taps;
+}
+
+sycl::float2 complex_mul(sycl::float2 a, sycl::float2 b) {
+  return sycl::float2(a.x() * b.x() - a.y() * b.y(),
+                      a.x() * b.y() + a.y() * b.x());
+}
+
+// In-place radix-2 FFT along one axis (1: rows, 0: columns) of the
+// planeRows x columns planes stacked in `grid`: a bit-reversal
+// permutation, then one kernel per butterfly stage.  Twiddles are
+// computed in the kernel rather than looked up.  The inverse is
+// unscaled.
+void submit_fft_axis(band_job& job, sycl::buffer<sycl::float2, 2>& grid,
+                     int planeRows, int axis, bool inverse) {
+  int columns = grid.get_range()[1];
+  int planes = grid.get_range()[0] / planeRows;
+  int n = (axis == 1) ? columns : planeRows;
+  int lines = (axis == 1) ? planes * planeRows : planes * columns;
+  int bits = 0;
+  while ((1 << bits) < n) ++bits;
+
+  // Element `pos` of sequence `line`.
+  auto at = [=](int line, int pos) {
+    return (axis == 1) ? sycl::id<2>(line, pos)
+                       : sycl::id<2>((line / columns) * planeRows + pos,
+                                     line % columns);
+  };
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor gridAccessor{grid, cgh, sycl::read_write};
+
+    cgh.parallel_for(sycl::range(lines, n), [=](sycl::id<2> idx) {
+      int line = idx[0];
+      int i = idx[1];
+      int j = 0;
+      for (int b = 0; b < bits; ++b) j |= ((i >> b) & 1) << (bits - 1 - b);
+      if (i < j) {
+        auto t = gridAccessor[at(line, i)];
+        gridAccessor[at(line, i)] = gridAccessor[at(line, j)];
+        gridAccessor[at(line, j)] = t;
+      }
+    });
+  }));
+
+  float pi = std::acos(-1.0f);
+  for (int m = 2; m <= n; m *= 2) {
+    float step = (inverse ? 2.0f : -2.0f) * pi / m;
+
+    job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+      sycl::accessor gridAccessor{grid, cgh, sycl::read_write};
+
+      cgh.parallel_for(sycl::range(lines, n / 2), [=](sycl::id<2> idx) {
+        int line = idx[0];
+        int k = idx[1];
+        int half = m / 2;
+        int j = k % half;
+        int base = (k / half) * m;
+        float angle = step * j;
+        sycl::float2 w(sycl::cos(angle), sycl::sin(angle));
+
+        auto a = gridAccessor[at(line, base + j)];
+        auto b = complex_mul(gridAccessor[at(line, base + j + half)], w);
+        gridAccessor[at(line, base + j)] = a + b;
+        gridAccessor[at(line, base + j + half)] = a - b;
+      });
+    }));
+  }
+}
+
+// Spectrum of each channel of `filter`, zero-padded to the planes of
+// `spectrumBuf` (gridRows rows each), conjugated because the kernels
+// correlate rather than convolve, and scaled to undo the unscaled
+// inverse transform.  Computed on the host with util::fft2d.
+void fill_spectrum(sycl::buffer<sycl::float2, 2>& spectrumBuf,
+                   const util::image_ref<float>& filter, int gridRows) {
+  int channels = filter.channels();
+  int filterWidth = filter.width();
+  int gridColumns = spectrumBuf.get_range()[1];
+  double scale = 1.0 / (static_cast<double>(gridRows) * gridColumns);
+
+  sycl::host_accessor spectrum{spectrumBuf, sycl::write_only, sycl::no_init};
+  std::vector<std::complex<double>> plane(gridRows * gridColumns);
+  for (int i = 0; i < channels; ++i) {
+    std::fill(plane.begin(), plane.end(), 0.0);
+    for (int r = 0; r < filterWidth; ++r) {
+      for (int c = 0; c < filterWidth; ++c) {
+        plane[r * gridColumns + c] =
+            filter.data()[(r * filterWidth + c) * channels + i];
+      }
+    }
+    util::fft2d(plane, gridRows, gridColumns, false);
+    for (int r = 0; r < gridRows; ++r) {
+      for (int c = 0; c < gridColumns; ++c) {
+        auto value = std::conj(plane[r * gridColumns + c]) * scale;
+        spectrum[i * gridRows + r][c] =
+            sycl::float2(static_cast<float>(value.real()),
+                         static_cast<float>(value.imag()));
+      }
+    }
+  }
+}
+
+// Convolution through the frequency domain, for large filters that
+// aren't separable.  Each channel of the padded band is zero-padded
+// to a power-of-two grid big enough that the circular convolution
+// doesn't wrap into the output, transformed, multiplied by the
+// filter's spectrum and transformed back.
+void submit_fft(band_job& job, const util::image_ref<float>& filter) {
+  auto channels = job.channels;
+  auto halo = job.halo;
+  int inRows = job.in.get_range()[0];
+  int inColumns = job.in.get_range()[1] / channels;
+  int gridRows = fft_size(inRows);
+  int gridColumns = fft_size(inColumns);
+  auto gridRange = sycl::range(channels * gridRows, gridColumns);
+
+  // Complex grids live in the band's scratch as pairs of floats.
+  auto complexScratch = [&] {
+    return job.scratch
+        .emplace_back(sycl::range(gridRange[0], gridRange[1] * 2))
+        .reinterpret<sycl::float2, 2>(gridRange);
+  };
+  auto spectrumBuf = complexScratch();
+  auto gridBuf = complexScratch();
+
+  fill_spectrum(spectrumBuf, filter, gridRows);
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor gridAccessor{gridBuf, cgh, sycl::write_only, sycl::no_init};
+
+    cgh.parallel_for(gridRange, [=](sycl::id<2> idx) {
+      int i = idx[0] / gridRows;
+      int y = idx[0] % gridRows;
+      int x = idx[1];
+      float value = 0.0f;
+      if (y < inRows && x < inColumns) value = inAccessor[y][x * channels + i];
+      gridAccessor[idx] = sycl::float2(value, 0.0f);
+    });
+  }));
+
+  submit_fft_axis(job, gridBuf, gridRows, 1, false);
+  submit_fft_axis(job, gridBuf, gridRows, 0, false);
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor gridAccessor{gridBuf, cgh, sycl::read_write};
+    sycl::accessor spectrumAccessor{spectrumBuf, cgh, sycl::read_only};
+
+    cgh.parallel_for(gridRange, [=](sycl::id<2> idx) {
+      gridAccessor[idx] = complex_mul(gridAccessor[idx], spectrumAccessor[idx]);
+    });
+  }));
+
+  submit_fft_axis(job, gridBuf, gridRows, 1, true);
+  submit_fft_axis(job, gridBuf, gridRows, 0, true);
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor gridAccessor{gridBuf, cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+
+    cgh.parallel_for(job.out.get_range(), [=](sycl::id<2> idx) {
+      int i = idx[1] % channels;
+      int x = idx[1] / channels;
+      float centre = inAccessor[idx[0] + halo][idx[1] + halo * channels];
+      outAccessor[idx] = to_pixel(
+          blur_result(gridAccessor[i * gridRows + idx[0]][x].x(), centre));
+    });
+  }));
+}
+
+// Recursion coefficients of Young and van Vliet's recursive Gaussian
+// ("Recursive implementation of the Gaussian filter", 1995):
+// {B, b1/b0, b2/b0, b3/b0}.  Sigma 0 gives {1, 0, 0, 0}, a copy.
+std::array<float, 4> iir_coefficients(float sigma) {
+  if (sigma <= 0.0f) return {1.0f, 0.0f, 0.0f, 0.0f};
+
+  sigma = std::max(sigma, 0.5f);
+  double q = (sigma >= 2.5f)
+                 ? 0.98711 * sigma - 0.96330
+                 : 3.97156 - 4.14554 * std::sqrt(1.0 - 0.26891 * sigma);
+  double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+  double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+  double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+  double b3 = 0.422205 * q * q * q;
+
+  return {static_cast<float>(1.0 - (b1 + b2 + b3) / b0),
+          static_cast<float>(b1 / b0), static_cast<float>(b2 / b0),
+          static_cast<float>(b3 / b0)};
+}
+
+// Samples a recursive Gaussian of `sigma` needs beyond a band's edge
+// to settle: the distance past which its impulse response (both
+// passes) holds less than 1/256 of its weight, so that restarting the
+// recursion there, from clamped samples, moves an output by under a
+// level even across a full-contrast edge.  This, not a tap
+// count, is the recursive engine's halo.
+int iir_settle_length(float sigma) {
+  auto [b, a1, a2, a3] = iir_coefficients(sigma);
+  int reach = std::max(16, static_cast<int>(std::ceil(16.0f * sigma)));
+  std::vector<double> line(2 * reach + 1, 0.0);
+  line[reach] = 1.0;
+
+  double w1 = 0.0, w2 = 0.0, w3 = 0.0;
+  for (auto& value : line) {
+    value = b * value + a1 * w1 + a2 * w2 + a3 * w3;
+    w3 = w2, w2 = w1, w1 = value;
+  }
+  w1 = w2 = w3 = 0.0;
+  for (auto it = line.rbegin(); it != line.rend(); ++it) {
+    *it = b * *it + a1 * w1 + a2 * w2 + a3 * w3;
+    w3 = w2, w2 = w1, w1 = *it;
+  }
+
+  // Weight beyond distance d on both sides, growing from the ends in.
+  double total = 0.0;
+  for (double value : line) total += std::abs(value);
+  double outside = 0.0;
+  for (int d = reach; d > 0; --d) {
+    outside += std::abs(line[reach - d]) + std::abs(line[reach + d]);
+    if (outside >= total / 256.0) return d;
+  }
+  return 1;
+}
+
+// Recursive Gaussian: along every line a causal pass
+// w[n] = B x[n] + a1 w[n-1] + a2 w[n-2] + a3 w[n-3] and then an
+// anticausal one running back over w, so the cost per pixel is a
+// dozen multiply-adds whatever sigma is.  The recursions start from
+// the band's clamped edge samples, as if the picture continued with
+// them, which is why the band only needs iir_settle_length of halo.
+// Sigma 0 copies a channel (the alpha of an RGBA blur).
+//
+// The vertical pass runs one work-item per column and channel, so
+// neighbouring work-items read neighbouring samples of every row.  In
+// the horizontal pass a row's samples are walked in order, so it runs
+// one work-item per padded row in groups of iirBlock[0] rows; a group
+// moves its rows through local memory iirBlock[1] pixels at a time,
+// every work-item copying consecutive samples of a row, and each
+// work-item recurses along its own row out of the local block.  Both
+// passes filter in place in the intermediate.
+void submit_gaussian_iir(band_job& job, const std::vector<float>& sigmas) {
+  auto channels = job.channels;
+  auto halo = job.halo;
+  auto width = job.width;
+  auto height = job.height;
+  int paddedHeight = job.in.get_range()[0];
+  int paddedWidth = job.in.get_range()[1] / channels;
+
+  auto coefficientBuf = job.scratch.emplace_back(sycl::range<2>(channels, 4));
+  {
+    sycl::host_accessor coefficients{coefficientBuf, sycl::write_only,
+                                     sycl::no_init};
+    for (int i = 0; i < channels; ++i) {
+      auto c = iir_coefficients(sigmas[i]);
+      for (int k = 0; k < 4; ++k) coefficients[i][k] = c[k];
+    }
+  }
+  auto tmpBuf = job.scratch.emplace_back(job.in.get_range());
+
+  int blockRows = iirBlock[0];
+  int blockColumns = iirBlock[1];
+  auto groups = (paddedHeight + blockRows - 1) / blockRows;
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor coefficientAccessor{coefficientBuf, cgh, sycl::read_only};
+    sycl::accessor tmpAccessor{tmpBuf, cgh, sycl::read_write, sycl::no_init};
+    // One spare sample per row, so the rows' recursions, which read
+    // down a column of the block, fall into different banks.
+    sycl::local_accessor<float, 2> blockAccessor{
+        sycl::range(blockRows, blockColumns * channels + 1), cgh};
+
+    cgh.parallel_for(
+        sycl::nd_range(sycl::range(groups * blockRows), sycl::range(blockRows)),
+        [=](sycl::nd_item<1> item) {
+          int r = item.get_local_id(0);
+          int row0 = item.get_group(0) * blockRows;
+          int groupRows = sycl::min(blockRows, paddedHeight - row0);
+
+          float b[4], a1[4], a2[4], a3[4];
+          float w1[4], w2[4], w3[4];
+          for (int i = 0; i < channels; ++i) {
+            b[i] = coefficientAccessor[i][0];
+            a1[i] = coefficientAccessor[i][1];
+            a2[i] = coefficientAccessor[i][2];
+            a3[i] = coefficientAccessor[i][3];
+          }
+
+          // The group's rows, pixels [x0, x0 + n), between global
+          // memory and the local block.
+          auto load = [&](const auto& source, int x0, int n) {
+            for (int e = r; e < groupRows * n * channels; e += blockRows) {
+              int br = e / (n * channels);
+              int q = e % (n * channels);
+              blockAccessor[br][q] = source[row0 + br][x0 * channels + q];
+            }
+            sycl::group_barrier(item.get_group());
+          };
+          auto store = [&](int x0, int n) {
+            sycl::group_barrier(item.get_group());
+            for (int e = r; e < groupRows * n * channels; e += blockRows) {
+              int br = e / (n * channels);
+              int q = e % (n * channels);
+              tmpAccessor[row0 + br][x0 * channels + q] = blockAccessor[br][q];
+            }
+            sycl::group_barrier(item.get_group());
+          };
+          // One step of the recursion at pixel k of the block, starting
+          // afresh from the sample at the line's first pixel.
+          auto step = [&](int k, bool first) {
+            for (int i = 0; i < channels; ++i) {
+              float& value = blockAccessor[r][k * channels + i];
+              if (first) w1[i] = w2[i] = w3[i] = value;
+              float w = b[i] * value + a1[i] * w1[i] + a2[i] * w2[i] +
+                        a3[i] * w3[i];
+              value = w;
+              w3[i] = w2[i];
+              w2[i] = w1[i];
+              w1[i] = w;
+            }
+          };
+
+          for (int x0 = 0; x0 < paddedWidth; x0 += blockColumns) {
+            int n = sycl::min(blockColumns, paddedWidth - x0);
+            load(inAccessor, x0, n);
+            if (r < groupRows) {
+              for (int k = 0; k < n; ++k) step(k, x0 + k == 0);
+            }
+            store(x0, n);
+          }
+
+          for (int x0 = (paddedWidth - 1) / blockColumns * blockColumns;
+               x0 >= 0; x0 -= blockColumns) {
+            int n = sycl::min(blockColumns, paddedWidth - x0);
+            load(tmpAccessor, x0, n);
+            if (r < groupRows) {
+              for (int k = n - 1; k >= 0; --k) {
+                step(k, x0 + k == paddedWidth - 1);
+              }
+            }
+            store(x0, n);
+          }
+        });
+  }));
+
+  // In place along `n` samples of a line, element k at line(k).
+  auto recurse = [](auto line, int n, float b, float a1, float a2, float a3) {
+    float w1 = line(0), w2 = w1, w3 = w1;
+    for (int k = 0; k < n; ++k) {
+      float w = b * line(k) + a1 * w1 + a2 * w2 + a3 * w3;
+      line(k) = w;
+      w3 = w2;
+      w2 = w1;
+      w1 = w;
+    }
+    w1 = line(n - 1), w2 = w1, w3 = w1;
+    for (int k = n - 1; k >= 0; --k) {
+      float w = b * line(k) + a1 * w1 + a2 * w2 + a3 * w3;
+      line(k) = w;
+      w3 = w2;
+      w2 = w1;
+      w1 = w;
+    }
+  };
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor tmpAccessor{tmpBuf, cgh, sycl::read_write};
+    sycl::accessor coefficientAccessor{coefficientBuf, cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+
+    cgh.parallel_for(sycl::range(width * channels), [=](sycl::id<1> idx) {
+      int i = idx[0] % channels;
+      int column = idx[0] + halo * channels;
+      recurse([&](int k) -> float& { return tmpAccessor[k][column]; },
+              paddedHeight, coefficientAccessor[i][0],
+              coefficientAccessor[i][1], coefficientAccessor[i][2],
+              coefficientAccessor[i][3]);
+      for (int y = 0; y < height; ++y) {
+        float centre = inAccessor[y + halo][column];
+        outAccessor[y][idx[0]] =
+            to_pixel(blur_result(tmpAccessor[y + halo][column], centre));
+      }
+    });
+  }));
+}
+
+// Bilateral filter: the weight of each neighbour is its spatial tap
+// (a Gaussian) times a range weight for how far its value is from the
+// centre pixel's, and the sum is divided by the total weight, so
+// pixels across an edge barely mix.  Range weights come from a table
+// indexed by the difference in levels, which every work-group copies
+// into local memory before it starts; otherwise this is the direct
+// kernel, with filterWidth^2 taps per sample and no tap shared between
+// passes, so it is the most compute-bound engine here.
+void submit_bilateral(band_job& job, sycl::buffer<float, 2>& filterBuf,
+                      int filterWidth, const std::vector<float>& rangeWeights) {
+  auto channels = job.channels;
+  auto width = job.width;
+  auto height = job.height;
+  auto halo = job.halo;
+  int levels = rangeWeights.size();
+  auto tile = tile_shape(job.queue.get_device(), 1, channels)
+                  .value_or(sycl::range<2>(1, 1));
+  auto globalRange =
+      sycl::range((height + tile[0] - 1) / tile[0] * tile[0],
+                  (width + tile[1] - 1) / tile[1] * tile[1]);
+  // The plan the table belongs to outlives the job.
+  auto rangeBuf = job.scratch.emplace_back(rangeWeights.data(),
+                                           sycl::range(1, levels));
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+    sycl::accessor filterAccessor{filterBuf, cgh, sycl::read_only};
+    sycl::accessor rangeAccessor{rangeBuf, cgh, sycl::read_only};
+    sycl::local_accessor<float, 1> tableAccessor{sycl::range(levels), cgh};
+
+    cgh.parallel_for(
+        sycl::nd_range(globalRange, tile), [=](sycl::nd_item<2> item) {
+          int groupSize = tile[0] * tile[1];
+          for (int k = item.get_local_linear_id(); k < levels;
+               k += groupSize) {
+            tableAccessor[k] = rangeAccessor[0][k];
+          }
+          sycl::group_barrier(item.get_group());
+
+          int y = item.get_global_id(0);
+          int x = item.get_global_id(1);
+          if (y >= height || x >= width) return;
+
+          for (int i = 0; i < channels; ++i) {
+            float centre = inAccessor[y + halo][(x + halo) * channels + i];
+            float sum = 0.0f;
+            float total = 0.0f;
+            for (int r = 0; r < filterWidth; ++r) {
+              for (int c = 0; c < filterWidth; ++c) {
+                float value = inAccessor[y + r][(x + c) * channels + i];
+                int level = sycl::min(
+                    static_cast<int>(sycl::fabs(value - centre) + 0.5f),
+                    levels - 1);
+                float weight =
+                    filterAccessor[r][c * channels + i] * tableAccessor[level];
+                sum += weight * value;
+                total += weight;
+              }
+            }
+            outAccessor[y][x * channels + i] = to_pixel(sum / total);
+          }
+        });
+  }));
+}
+
+// One pass of a morphology engine: a minimum (erode) or maximum
+// (dilate) over a filterWidth x filterWidth rectangle.
+enum class morph_op { erode, dilate };
+
+// Minimum or maximum over filterWidth samples along one axis, by van
+// Herk and Gil-Werman: each line is cut into segments of filterWidth
+// samples, and the window starting at a sample is the suffix of its
+// segment plus a prefix of the next one.  A work-item takes one
+// segment of one line: it parks the suffixes in the destination,
+// walking backwards, then walks the next segment forwards and folds
+// the running prefix in.  That is three comparisons per sample
+// whatever the width.  Lines are rows (horizontal) or columns of
+// sourceBuf, one channel each, and the destination is 2 * (filterWidth
+// / 2) samples shorter along the axis, like a convolution's output.
+// Channels in copiedChannels are passed through.
+template <typename Source, typename Destination>
+void submit_van_herk(band_job& job, sycl::buffer<Source, 2>& sourceBuf,
+                     sycl::buffer<Destination, 2>& destinationBuf,
+                     int filterWidth, morph_op op, bool horizontal,
+                     int copiedChannels) {
+  auto channels = job.channels;
+  int halo = filterWidth / 2;
+  auto range = destinationBuf.get_range();
+  int lines = horizontal ? range[0] * channels : range[1];
+  int length = horizontal ? range[1] / channels : range[0];
+  int segments = (length + filterWidth - 1) / filterWidth;
+  bool erode = (op == morph_op::erode);
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor sourceAccessor{sourceBuf, cgh, sycl::read_only};
+    sycl::accessor destinationAccessor{destinationBuf, cgh, sycl::read_write,
+                                       sycl::no_init};
+
+    cgh.parallel_for(sycl::range(lines, segments), [=](sycl::id<2> idx) {
+      int line = idx[0];
+      int i = line % channels;
+      auto source = [&](int k) -> float {
+        return horizontal ? sourceAccessor[line / channels][k * channels + i]
+                          : sourceAccessor[k][line];
+      };
+      auto destination = [&](int k) -> Destination& {
+        return horizontal
+                   ? destinationAccessor[line / channels][k * channels + i]
+                   : destinationAccessor[k][line];
+      };
+      auto combine = [=](float a, float b) {
+        return erode ? sycl::fmin(a, b) : sycl::fmax(a, b);
+      };
+
+      int start = idx[1] * filterWidth;
+      int end = sycl::min(start + filterWidth, length);
+
+      if (copiedChannels & (1 << i)) {
+        for (int k = start; k < end; ++k) {
+          destination(k) = to_pixel(source(k + halo));
+        }
+        return;
+      }
+
+      float run = source(start + filterWidth - 1);
+      for (int k = start + filterWidth - 1; k >= start; --k) {
+        run = combine(run, source(k));
+        if (k < end) destination(k) = to_pixel(run);
+      }
+      for (int k = start + 1; k < end; ++k) {
+        float next = source(k + filterWidth - 1);
+        run = (k == start + 1) ? next : combine(run, next);
+        destination(k) = to_pixel(combine(destination(k), run));
+      }
+    });
+  }));
+}
+
+// Erosion, dilation, opening (erode, dilate) or closing (dilate,
+// erode) with a filterWidth x filterWidth rectangle: every pass is a
+// horizontal and a vertical van Herk/Gil-Werman pass, through
+// intermediates that stay on the device.  Each pass uses up
+// filterWidth / 2 of the band's padding, so a two-pass job needs
+// twice the halo of a blur.
+void submit_morphology(band_job& job, int filterWidth,
+                       const std::vector<morph_op>& passes,
+                       int copiedChannels) {
+  int halo = filterWidth / 2;
+  assert(job.halo == halo * static_cast<int>(passes.size()));
+  auto rowLength = job.width * job.channels;
+
+  std::optional<sycl::buffer<float, 2>> current;  // job.in to begin with
+  for (std::size_t k = 0; k < passes.size(); ++k) {
+    int padding = job.halo - halo * static_cast<int>(k);
+    auto rowsBuf = job.scratch.emplace_back(sycl::range(
+        job.height + 2 * padding, rowLength + 2 * (padding - halo) *
+                                                  job.channels));
+    if (current) {
+      submit_van_herk(job, *current, rowsBuf, filterWidth, passes[k], true,
+                      copiedChannels);
+    } else {
+      submit_van_herk(job, job.in, rowsBuf, filterWidth, passes[k], true,
+                      copiedChannels);
+    }
+    if (k + 1 == passes.size()) {
+      submit_van_herk(job, rowsBuf, job.out, filterWidth, passes[k], false,
+                      copiedChannels);
+    } else {
+      current = job.scratch.emplace_back(
+          sycl::range(job.height + 2 * (padding - halo),
+                      rowLength + 2 * (padding - halo) * job.channels));
+      submit_van_herk(job, rowsBuf, *current, filterWidth, passes[k], false,
+                      copiedChannels);
+    }
+  }
+}
+
+// Median filter in constant time per pixel, after Perreault and
+// Hebert.  A work-item walks medianBlocks of output pixels of one
+// channel, one block after another, row by row, keeping a 256-bin
+// histogram of every input column its windows cover, over the current
+// window's rows.  Moving
+// down a row takes one sample out of each column histogram and puts
+// one in; moving right adds the entering column's histogram to the
+// window's and subtracts the leaving column's.  Neither step depends
+// on filterWidth, and neither does finding the median, which is
+// carried from pixel to pixel instead of being searched for.  Column
+// histograms live in global memory, bin-major with the work-items
+// side by side so neighbouring work-items' accesses coalesce, and
+// there are only as many work-items as medianHistogramBytes holds
+// histograms for, however large the picture.
+// Samples are taken as 8-bit levels; channels in copiedChannels (a
+// bitmask) are passed through.
+void submit_median(band_job& job, int filterWidth, int copiedChannels) {
+  auto channels = job.channels;
+  auto width = job.width;
+  auto height = job.height;
+  auto halo = job.halo;
+  int blockRows = medianBlock[0];
+  int blockColumns = medianBlock[1];
+  int blocksAcross = (width + blockColumns - 1) / blockColumns;
+  int blocksDown = (height + blockRows - 1) / blockRows;
+  int items = blocksDown * blocksAcross * channels;
+  int columns = blockColumns + filterWidth - 1;
+  // Samples in a window below the median: the upper median for an even
+  // number of taps.
+  int rank = filterWidth * filterWidth / 2;
+  // Work-items at once, each taking blocks one after another with its
+  // own set of column histograms.
+  auto histogramBytes = static_cast<size_t>(columns) * 256 *
+                        sizeof(std::uint16_t);
+  int slots = static_cast<int>(std::clamp<size_t>(
+      medianHistogramBytes / histogramBytes, 1, items));
+  job.histograms.emplace(sycl::range(columns * 256, slots));
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor inAccessor{job.in, cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+    sycl::accessor histogramAccessor{*job.histograms, cgh, sycl::read_write,
+                                     sycl::no_init};
+
+    cgh.parallel_for(sycl::range(slots), [=](sycl::id<1> idx) {
+      int slot = idx[0];
+      for (int item = slot; item < items; item += slots) {
+        int i = item % channels;
+        int block = item / channels;
+        int y0 = block / blocksAcross * blockRows;
+        int x0 = block % blocksAcross * blockColumns;
+        int y1 = sycl::min(y0 + blockRows, height);
+        int x1 = sycl::min(x0 + blockColumns, width);
+
+        if (copiedChannels & (1 << i)) {
+          for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+              outAccessor[y][x * channels + i] =
+                  inAccessor[y + halo][(x + halo) * channels + i];
+            }
+          }
+          continue;
+        }
+
+        // Level of padded input sample (row, column), and bin `bin` of
+        // the histogram of input column x0 + j.
+        auto level = [&](int row, int column) {
+          float value = inAccessor[row][column * channels + i];
+          return sycl::clamp(static_cast<int>(sycl::round(value)), 0, 255);
+        };
+        auto histogram = [&](int j, int bin) -> std::uint16_t& {
+          return histogramAccessor[j * 256 + bin][slot];
+        };
+
+        int usedColumns = x1 - x0 + filterWidth - 1;
+        for (int j = 0; j < usedColumns; ++j) {
+          for (int bin = 0; bin < 256; ++bin) histogram(j, bin) = 0;
+          for (int r = 0; r < filterWidth; ++r) {
+            ++histogram(j, level(y0 + r, x0 + j));
+          }
+        }
+
+        // Histogram of the window of the row's first pixel, moved down
+        // with the rows.
+        std::uint16_t first[256];
+        for (int bin = 0; bin < 256; ++bin) {
+          int count = 0;
+          for (int j = 0; j < filterWidth; ++j) count += histogram(j, bin);
+          first[bin] = count;
+        }
+
+        for (int y = y0; y < y1; ++y) {
+          if (y > y0) {
+            for (int j = 0; j < usedColumns; ++j) {
+              --histogram(j, level(y - 1, x0 + j));
+              ++histogram(j, level(y - 1 + filterWidth, x0 + j));
+            }
+            for (int j = 0; j < filterWidth; ++j) {
+              --first[level(y - 1, x0 + j)];
+              ++first[level(y - 1 + filterWidth, x0 + j)];
+            }
+          }
+
+          std::uint16_t window[256];
+          for (int bin = 0; bin < 256; ++bin) window[bin] = first[bin];
+          int median = 0;
+          int below = 0;  // samples of the window under `median`
+          while (below + window[median] <= rank) below += window[median++];
+          outAccessor[y][x0 * channels + i] =
+              to_pixel(static_cast<float>(median));
+
+          for (int x = x0 + 1; x < x1; ++x) {
+            int leaving = x - 1 - x0;
+            int entering = leaving + filterWidth;
+            for (int bin = 0; bin < 256; ++bin) {
+              int delta = histogram(entering, bin) - histogram(leaving, bin);
+              window[bin] += delta;
+              if (bin < median) below += delta;
+            }
+            while (below > rank) below -= window[--median];
+            while (below + window[median] <= rank) below += window[median++];
+            outAccessor[y][x * channels + i] =
+                to_pixel(static_cast<float>(median));
+          }
+        }
+      }
+    });
+  }));
+}
+
+// Canny edge detection of a band's blur.  Each stage is a kernel of
+// its own on the band's queue, and everything between them stays on
+// the device; only the finished edge map in job.out goes back to the
+// host.  Bands split a picture by rows: the stencils read a ring of
+// blurred rows beyond the band, and the hysteresis sweeps pass class
+// rows between neighbouring bands, so edges are followed across the
+// whole picture.
+//
+// submit_canny_classes takes the Sobel gradient (magnitude and
+// direction, in scratch), thins it to the samples that are a maximum
+// across the edge, and classes those by the two thresholds.
+// canny_hysteresis then promotes the weak samples connected to strong
+// ones, and submit_canny_edges writes the strong samples out.
+enum edge_class : int { not_edge = 0, weak_edge = 1, strong_edge = 2 };
+
+// `blurredBuf` is the blur of the band plus a two-pixel ring (height
+// + 4 rows of width + 4 pixels, see submit_widened_blur): thinning
+// compares gradients a row beyond the band, and those read a row
+// further.  The bands cover `pictureRows` rows, beyond which the blur
+// is clamped and there is no gradient, as if the band were the whole
+// picture.  Channel `keepChannel` is written blurred straight away.
+void submit_canny_classes(band_job& job, sycl::buffer<pixel_t, 2>& blurredBuf,
+                          int pictureRows, float low, float high,
+                          int keepChannel) {
+  auto channels = job.channels;
+  auto width = job.width;
+  auto height = job.height;
+  int firstRow = job.firstRow;
+  auto samples = job.out.get_range();
+  // Gradients of the band and of a row above and below it.
+  auto gradientSamples = samples + sycl::range(2, 0);
+  auto magnitudeBuf = job.scratch.emplace_back(gradientSamples);
+  auto directionBuf = job.scratch.emplace_back(gradientSamples);
+  auto classBuf = job.classes.emplace_back(samples);
+  job.classes.emplace_back(samples);  // the other half of each sweep
+  job.promotions.emplace(sycl::range(1));
+  // The neighbours' class rows along the band's top and bottom, none
+  // until canny_hysteresis passes them over.
+  job.borders.emplace(sycl::range(2, width * channels));
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor bordersAccessor{*job.borders, cgh, sycl::write_only,
+                                   sycl::no_init};
+    cgh.fill(bordersAccessor, static_cast<int>(not_edge));
+  }));
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor blurredAccessor{blurredBuf, cgh, sycl::read_only};
+    sycl::accessor magnitudeAccessor{magnitudeBuf, cgh, sycl::write_only,
+                                     sycl::no_init};
+    sycl::accessor directionAccessor{directionBuf, cgh, sycl::write_only,
+                                     sycl::no_init};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+
+    cgh.parallel_for(sycl::range(height + 2, width), [=](sycl::id<2> idx) {
+      int y = static_cast<int>(idx[0]) - 1;  // band row
+      int x = idx[1];
+      for (int i = 0; i < channels; ++i) {
+        auto blurred = [&](int dy, int dx) -> float {
+          int row = sycl::clamp(y + dy, -firstRow, pictureRows - 1 - firstRow);
+          int column = sycl::clamp(x + dx, 0, width - 1);
+          return blurredAccessor[row + 2][(column + 2) * channels + i];
+        };
+        if (i == keepChannel && y >= 0 && y < height) {
+          outAccessor[y][x * channels + i] = to_pixel(blurred(0, 0));
+        }
+        float gx = (blurred(-1, 1) - blurred(-1, -1)) +
+                   2.0f * (blurred(0, 1) - blurred(0, -1)) +
+                   (blurred(1, 1) - blurred(1, -1));
+        float gy = (blurred(1, -1) - blurred(-1, -1)) +
+                   2.0f * (blurred(1, 0) - blurred(-1, 0)) +
+                   (blurred(1, 1) - blurred(-1, 1));
+        // The gradient's direction to the nearest 45 degrees: 0 along
+        // x, 2 along y, 1 and 3 the diagonals (tan 22.5 = 0.414).
+        float ax = sycl::fabs(gx);
+        float ay = sycl::fabs(gy);
+        int direction = (ay <= 0.41421356f * ax)   ? 0
+                        : (ax <= 0.41421356f * ay) ? 2
+                        : (gx * gy > 0.0f)         ? 1
+                                                   : 3;
+        magnitudeAccessor[y + 1][x * channels + i] =
+            sycl::sqrt(gx * gx + gy * gy) / 4.0f;
+        directionAccessor[y + 1][x * channels + i] = direction;
+      }
+    });
+  }));
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor magnitudeAccessor{magnitudeBuf, cgh, sycl::read_only};
+    sycl::accessor directionAccessor{directionBuf, cgh, sycl::read_only};
+    sycl::accessor classAccessor{classBuf, cgh, sycl::write_only,
+                                 sycl::no_init};
+
+    cgh.parallel_for(sycl::range(height, width), [=](sycl::id<2> idx) {
+      // Step to the neighbour across the edge, per direction.
+      const int stepY[4] = {0, 1, 1, 1};
+      const int stepX[4] = {1, 1, 0, -1};
+      int y = idx[0];
+      int x = idx[1];
+      for (int i = 0; i < channels; ++i) {
+        auto magnitude = [&](int row, int column) -> float {
+          if (firstRow + row < 0 || firstRow + row >= pictureRows ||
+              column < 0 || column >= width) {
+            return 0.0f;
+          }
+          return magnitudeAccessor[row + 1][column * channels + i];
+        };
+        int d = static_cast<int>(directionAccessor[y + 1][x * channels + i]);
+        float m = magnitude(y, x);
+        // Ties go to the sample before, so a ridge two samples wide
+        // keeps one of them.
+        bool peak = m > magnitude(y - stepY[d], x - stepX[d]) &&
+                    m >= magnitude(y + stepY[d], x + stepX[d]);
+        int edgeClass = (i == keepChannel || !peak) ? not_edge
+                        : (m >= high)               ? strong_edge
+                        : (m >= low)                ? weak_edge
+                                                    : not_edge;
+        classAccessor[y][x * channels + i] = edgeClass;
+      }
+    });
+  }));
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor promotionsAccessor{*job.promotions, cgh, sycl::write_only,
+                                      sycl::no_init};
+    cgh.fill(promotionsAccessor, 0);
+  }));
+}
+
+// One hysteresis sweep: weak samples next to a strong one become
+// strong.  A work-group loads its tile of job.classes[0] and a
+// one-sample ring around it into local memory (the ring rows beyond
+// the band from job.borders) and keeps promoting there until the tile
+// settles, so one sweep follows an edge right across a tile; the tile
+// is written to job.classes[1], and job.promotions counts the
+// work-groups that promoted anything.
+void submit_hysteresis_sweep(band_job& job) {
+  auto channels = job.channels;
+  auto width = job.width;
+  auto height = job.height;
+  auto tile = tile_shape(job.queue.get_device(), 3, channels)
+                  .value_or(sycl::range<2>(1, 1));
+  int tileRows = tile[0];
+  int tileColumns = tile[1];
+  int ringRows = tileRows + 2;
+  int ringColumns = tileColumns + 2;
+  auto globalRange =
+      sycl::range((height + tileRows - 1) / tileRows * tileRows,
+                  (width + tileColumns - 1) / tileColumns * tileColumns);
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor fromAccessor{job.classes[0], cgh, sycl::read_only};
+    sycl::accessor bordersAccessor{*job.borders, cgh, sycl::read_only};
+    sycl::accessor toAccessor{job.classes[1], cgh, sycl::write_only,
+                              sycl::no_init};
+    sycl::accessor promotionsAccessor{*job.promotions, cgh, sycl::read_write};
+    sycl::local_accessor<int, 2> tileAccessor{
+        sycl::range(ringRows, ringColumns * channels), cgh};
+
+    cgh.parallel_for(
+        sycl::nd_range(globalRange, tile), [=](sycl::nd_item<2> item) {
+          int y0 = item.get_group(0) * tileRows;
+          int x0 = item.get_group(1) * tileColumns;
+          int groupSize = tileRows * tileColumns;
+
+          // Ring sample (r, c) is band sample (y0 + r - 1, x0 + c - 1).
+          // The rows just above and below the band are the neighbours'
+          // borders; further out, and beside the picture, there are no
+          // edges.
+          for (int k = item.get_local_linear_id(); k < ringRows * ringColumns;
+               k += groupSize) {
+            int r = k / ringColumns;
+            int c = k % ringColumns;
+            int row = y0 + r - 1;
+            int column = x0 + c - 1;
+            bool inside = row >= -1 && row <= height && column >= 0 &&
+                          column < width;
+            for (int i = 0; i < channels; ++i) {
+              int sample = column * channels + i;
+              tileAccessor[r][c * channels + i] =
+                  !inside         ? static_cast<int>(not_edge)
+                  : row < 0       ? bordersAccessor[0][sample]
+                  : row == height ? bordersAccessor[1][sample]
+                                  : fromAccessor[row][sample];
+            }
+          }
+          sycl::group_barrier(item.get_group());
+
+          int ly = item.get_local_id(0) + 1;
+          int lx = item.get_local_id(1) + 1;
+          int y = y0 + ly - 1;
+          int x = x0 + lx - 1;
+          // Work-items past the band's end only hold the neighbours'
+          // samples, which are theirs to promote.
+          bool inBand = y < height && x < width;
+          bool promotedAny = false;
+          while (true) {
+            int promote = 0;  // a bit per channel
+            for (int i = 0; i < channels && inBand; ++i) {
+              if (tileAccessor[ly][lx * channels + i] != weak_edge) continue;
+              for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                  if (tileAccessor[ly + dy][(lx + dx) * channels + i] ==
+                      strong_edge) {
+                    promote |= 1 << i;
+                  }
+                }
+              }
+            }
+            sycl::group_barrier(item.get_group());
+            for (int i = 0; i < channels; ++i) {
+              if (promote & (1 << i)) {
+                tileAccessor[ly][lx * channels + i] = strong_edge;
+              }
+            }
+            sycl::group_barrier(item.get_group());
+            if (!sycl::any_of_group(item.get_group(), promote != 0)) break;
+            promotedAny = true;
+          }
+
+          if (inBand) {
+            for (int i = 0; i < channels; ++i) {
+              toAccessor[y][x * channels + i] =
+                  tileAccessor[ly][lx * channels + i];
+            }
+          }
+          if (promotedAny && item.get_local_linear_id() == 0) {
+            sycl::atomic_ref<int, sycl::memory_order::relaxed,
+                             sycl::memory_scope::device,
+                             sycl::access::address_space::global_space>
+                count{promotionsAccessor[0]};
+            count.fetch_add(1);
+          }
+        });
+  }));
+
+  std::swap(job.classes[0], job.classes[1]);
+}
+
+// Copies row `row` of `from`'s latest classes into row `border` of
+// job.borders, on job's queue.
+void submit_border_copy(band_job& job, band_job& from, int row, int border) {
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor fromAccessor{from.classes[0], cgh, sycl::read_only};
+    sycl::accessor bordersAccessor{*job.borders, cgh, sycl::write_only};
+    cgh.parallel_for(sycl::range(fromAccessor.get_range()[1]),
+                     [=](sycl::id<1> idx) {
+                       bordersAccessor[border][idx[0]] = fromAccessor[row][idx[0]];
+                     });
+  }));
+}
+
+// Sweeps the bands until a sweep promotes nothing anywhere.  Before
+// each sweep a band takes the class rows along its top and bottom
+// from the bands it borders (one ending where the other starts), so
+// an edge crosses into the next band one sweep later.  A band sweeps
+// again only when it or a neighbour promoted something in the last
+// sweep.  All the sweeps are submitted before the host waits on any of
+// them, and the only thing read back between sweeps is each band's
+// promotion count.  Returns the number of sweeps.
+int canny_hysteresis(std::vector<band_job>& jobs) {
+  auto count = jobs.size();
+  auto borders = [&](std::size_t above, std::size_t below) {
+    return jobs[above].firstRow + jobs[above].height == jobs[below].firstRow;
+  };
+  std::vector<int> seen(count, 0);
+  std::vector<bool> promoted(count, false);
+  std::vector<bool> active(count, true);
+  int sweeps = 0;
+  while (std::find(active.begin(), active.end(), true) != active.end()) {
+    ++sweeps;
+    for (std::size_t j = 0; j < count; ++j) {
+      if (!active[j]) continue;
+      if (j > 0 && borders(j - 1, j)) {
+        submit_border_copy(jobs[j], jobs[j - 1], jobs[j - 1].height - 1, 0);
+      }
+      if (j + 1 < count && borders(j, j + 1)) {
+        submit_border_copy(jobs[j], jobs[j + 1], 0, 1);
+      }
+    }
+    for (std::size_t j = 0; j < count; ++j) {
+      if (active[j]) submit_hysteresis_sweep(jobs[j]);
+    }
+    for (std::size_t j = 0; j < count; ++j) {
+      promoted[j] = false;
+      if (!active[j]) continue;
+      sycl::host_accessor promotions{*jobs[j].promotions, sycl::read_only};
+      promoted[j] = (promotions[0] != seen[j]);
+      seen[j] = promotions[0];
+    }
+    for (std::size_t j = 0; j < count; ++j) {
+      active[j] = promoted[j] ||
+                  (j > 0 && borders(j - 1, j) && promoted[j - 1]) ||
+                  (j + 1 < count && borders(j, j + 1) && promoted[j + 1]);
+    }
+  }
+  return sweeps;
+}
+
+// The edge map: 255 where a sample ended up strong, 0 elsewhere.
+// Channel `keepChannel` keeps its blurred value.
+void submit_canny_edges(band_job& job, int keepChannel) {
+  auto channels = job.channels;
+
+  job.events.push_back(job.queue.submit([&](sycl::handler& cgh) {
+    sycl::accessor classAccessor{job.classes[0], cgh, sycl::read_only};
+    sycl::accessor outAccessor{job.out, cgh, sycl::write_only};
+
+    cgh.parallel_for(sycl::range(job.height, job.width), [=](sycl::id<2> idx) {
+      for (int i = 0; i < channels; ++i) {
+        if (i == keepChannel) continue;
+        bool edge = classAccessor[idx[0]][idx[1] * channels + i] == strong_edge;
+        outAccessor[idx[0]][idx[1] * channels + i] =
+            to_pixel(edge ? 255.0f : 0.0f);
+      }
+    });
+  }));
+}
+
+// Device time of all the kernels submitted for a band, in nanoseconds.
+double kernel_time(const band_job& job) {
+  double total = 0.0;
+  for (auto& e : job.events) {
+    total += e.get_profiling_info<sycl::info::event_profiling::command_end>() -
+             e.get_profiling_info<sycl::info::event_profiling::command_start>();
+  }
+  return total;
+}
+
+// Device time of the jobs dealt to queue `slot` (0, 1, 2 for
+// myQueue1, myQueue3, myQueue4), which get every third job.
+double slot_time(const std::vector<band_job>& jobs, int slot) {
+  double total = 0.0;
+  for (std::size_t i = slot; i < jobs.size(); i += 3) {
+    total += kernel_time(jobs[i]);
+  }
+  return total;
+}
+
+// A filter together with the engine chosen for it.  An interleaved
+// image has one plan for all its channels; a planar one has a plan
+// per plane, so e.g. the blurred colour planes of an RGBA picture can
+// take the running-sum engine while its identity alpha plane doesn't.
+struct blur_plan {
+  explicit blur_plan(util::image_ref<float> filter)
+      : filter{std::move(filter)} {}
+
+  util::image_ref<float> filter;
+  std::optional<util::separable_filter> separable;
+  std::optional<std::vector<float>> boxWeights;
+  std::vector<float> sigmas;  // per channel, for the recursive Gaussian
+  std::vector<float> rangeWeights;  // by level difference, for the
+                                    // bilateral filter
+  std::optional<util::separable_filter> lowRank;  // terms of the low-rank
+                                                 // engine, one after the
+                                                 // other
+  blur_engine engine = blur_engine::tiled;
+  float approximation = 0.0f;  // how far the engine may stray from the
+                               // filter's taps, in 8-bit levels
+  int copiedChannels = 0;  // bitmask of the channels the median and
+                           // morphology engines pass through
+  std::vector<morph_op> morphology;  // passes of the morphology engine
+};
+
+// Whether channel `channel` of `filter` is a single tap, as the alpha
+// of RGBA is.  Engines that don't convolve with the taps copy such
+// channels instead.
+bool single_tap(const util::image_ref<float>& filter, int channel) {
+  int taps = filter.width() * filter.height();
+  int nonZero = 0;
+  for (int k = 0; k < taps; ++k) {
+    nonZero += (filter.data()[k * filter.channels() + channel] != 0.0f);
+  }
+  return nonZero <= 1;
+}
+
+// Picks the engine for a `type` filter on a width x height image.
+// Filters generated with their 1D factors (Gaussians) pass them in
+// and skip the rank test.
+blur_plan plan_blur(util::image_ref<float> filter, util::filter_type type,
+                    int width, int height,
+                    std::optional<util::separable_filter> factors = {}) {
+  blur_plan plan{std::move(filter)};
+
+  if (type == util::filter_type::gaussian_iir) {
+    // The recursion stands in for the taps, which are iirSigma's;
+    // channels whose filter is a single tap (the alpha of RGBA) are
+    // copied.
+    for (int i = 0; i < plan.filter.channels(); ++i) {
+      plan.sigmas.push_back(single_tap(plan.filter, i) ? 0.0f : iirSigma);
+    }
+    plan.engine = blur_engine::gaussian_iir;
+    // The taps' 1D factors are still what edge detection, which blurs
+    // in local memory, convolves with.
+    plan.separable = factors ? std::move(factors)
+                              : util::separate_filter(plan.filter,
+                                                      separableTolerance);
+    // Young-van Vliet's impulse response is within about 3% of the
+    // Gaussian's peak; across a full-contrast edge that is a few levels.
+    plan.approximation = 4.0f;
+    return plan;
+  }
+
+  // Not a convolution, so no rank test: the taps are only the spatial
+  // half of the weights.
+  if (type == util::filter_type::bilateral) {
+    plan.rangeWeights = util::range_weights(bilateralSigma);
+    plan.engine = blur_engine::bilateral;
+    return plan;
+  }
+
+  // Nor is a median; its taps only say which channels are copied.
+  if (type == util::filter_type::median) {
+    for (int i = 0; i < plan.filter.channels(); ++i) {
+      if (single_tap(plan.filter, i)) plan.copiedChannels |= 1 << i;
+    }
+    plan.engine = blur_engine::median;
+    return plan;
+  }
+
+  // Morphology too, in one or two passes of minima and maxima.
+  if (type == util::filter_type::erode || type == util::filter_type::dilate ||
+      type == util::filter_type::opening ||
+      type == util::filter_type::closing) {
+    for (int i = 0; i < plan.filter.channels(); ++i) {
+      if (single_tap(plan.filter, i)) plan.copiedChannels |= 1 << i;
+    }
+    auto first = (type == util::filter_type::erode ||
+                  type == util::filter_type::opening)
+                     ? morph_op::erode
+                     : morph_op::dilate;
+    plan.morphology.push_back(first);
+    if (type == util::filter_type::opening ||
+        type == util::filter_type::closing) {
+      plan.morphology.push_back(first == morph_op::erode ? morph_op::dilate
+                                                         : morph_op::erode);
+    }
+    plan.engine = blur_engine::morphology;
+    return plan;
+  }
+
+  // Rank-1 filters (the box blur, the identity, Gaussians) are run as a
+  // horizontal plus a vertical pass instead of the full 2D convolution.
+  plan.separable = factors ? std::move(factors)
+                            : util::separate_filter(plan.filter,
+                                                    separableTolerance);
+  // Factors only close to the taps cost up to this much on a
+  // full-contrast picture.
+  if (plan.separable) {
+    plan.approximation =
+        255.0f * util::factor_error(plan.filter, *plan.separable);
+  }
+  // A box filter doesn't even need the taps: running sums make the
+  // cost per pixel independent of filterWidth.
+  if (plan.separable) {
+    plan.boxWeights =
+        util::box_weights(*plan.separable, plan.filter.channels());
+  }
+
+  // Otherwise a few separable terms may come close enough, at
+  // 2 * filterWidth multiply-adds per term and pixel, which has to beat
+  // the direct kernels' filterWidth^2.
+  int directTaps = plan.filter.width() * plan.filter.width();
+  if (!plan.separable) {
+    plan.lowRank = util::low_rank_filter(
+        plan.filter, lowRankTolerance / 255.0f, lowRankMax);
+  }
+  int lowRankTaps = 0;
+  if (plan.lowRank) {
+    lowRankTaps = 2 * static_cast<int>(plan.lowRank->row.size()) /
+                  plan.filter.channels();
+    if (lowRankTaps >= directTaps) plan.lowRank.reset();
+  }
+
+  plan.engine =
+      plan.boxWeights  ? blur_engine::running_sum
+      : plan.separable ? blur_engine::separable
+      : plan.lowRank && !fft_pays_off(width, height, plan.filter.width(),
+                                      lowRankTaps)
+          ? blur_engine::low_rank
+      : fft_pays_off(width, height, plan.filter.width())
+          ? blur_engine::fft
+          : blur_engine::tiled;
+
+#ifdef FORCE_ENGINE
+  // Benchmark builds (make images) pin one engine, where the filter
+  // allows it.
+  auto forced = blur_engine::FORCE_ENGINE;
+  if ((forced != blur_engine::separable || plan.separable) &&
+      (forced != blur_engine::running_sum || plan.boxWeights) &&
+      (forced != blur_engine::low_rank || plan.lowRank) &&
+      forced != blur_engine::gaussian_iir &&
+      forced != blur_engine::bilateral && forced != blur_engine::median &&
+      forced != blur_engine::morphology) {
+    plan.engine = forced;
+  }
+#endif
+  if (plan.engine == blur_engine::low_rank) {
+    plan.approximation =
+        255.0f * util::factor_error(plan.filter, *plan.lowRank);
+  }
+  return plan;
+}
+
+// Submits `job`'s blur on the engine `plan` chose.  `inImage` and
+// `plane` are what the sampled-image engine reads instead of job.in;
+// StripHeight is the blocked kernel's.
+template <int StripHeight>
+void submit_blur(band_job& job, const blur_plan& plan,
+                 sycl::buffer<float, 2>& filterBuf,
+                 const util::image_ref<pixel_t>& inImage, int plane,
+                 sycl::range<2> localRange) {
+  int filterWidth = plan.filter.width();
+
+  switch (plan.engine) {
+    case blur_engine::direct:
+      submit_conv2d(job, filterBuf, filterWidth, localRange);
+      break;
+    case blur_engine::blocked:
+      submit_blocked<StripHeight>(job, filterBuf, filterWidth, localRange);
+      break;
+    case blur_engine::tiled:
+      // Large filters whose tile won't fit local memory are the
+      // memory-bound case the blocked kernel is for.
+      if (tile_shape(job.queue.get_device(), filterWidth, job.channels)) {
+        submit_tiled_specialized(job, filterBuf, filterWidth, localRange);
+      } else {
+        submit_blocked<StripHeight>(job, filterBuf, filterWidth, localRange);
+      }
+      break;
+    case blur_engine::separable:
+      // Sub-group shuffles pay off on GPUs, where lanes of a
+      // sub-group share a register file.
+      submit_separable(job, *plan.separable, job.queue.get_device().is_gpu());
+      break;
+    case blur_engine::running_sum:
+      submit_running_sum(job, *plan.boxWeights, filterWidth);
+      break;
+    case blur_engine::fft:
+      submit_fft(job, plan.filter);
+      break;
+    case blur_engine::low_rank:
+      submit_low_rank(job, *plan.lowRank, filterWidth);
+      break;
+    case blur_engine::gaussian_iir:
+      submit_gaussian_iir(job, plan.sigmas);
+      break;
+    case blur_engine::sampled_image:
+      submit_sampled_image(job, inImage, plane, filterBuf, filterWidth,
+                           localRange);
+      break;
+    case blur_engine::bilateral:
+      submit_bilateral(job, filterBuf, filterWidth, plan.rangeWeights);
+      break;
+    case blur_engine::median:
+      submit_median(job, filterWidth, plan.copiedChannels);
+      break;
+    case blur_engine::morphology:
+      submit_morphology(job, filterWidth, plan.morphology,
+                        plan.copiedChannels);
+      break;
+  }
+}
+
+// `job`'s blur on the engine `plan` chose, widened by `ring` pixels on
+// every side for the gradient kernels to read, into a device-only
+// picture of the band's (height + 2 * ring rows of width + 2 * ring
+// pixels).  The band's halo has to cover the filter's and the ring.
+template <int StripHeight>
+sycl::buffer<pixel_t, 2> submit_widened_blur(
+    band_job& job, int ring, const blur_plan& plan,
+    sycl::buffer<float, 2>& filterBuf, const util::image_ref<pixel_t>& inImage,
+    int plane, sycl::range<2> localRange) {
+  auto blurred = job.pictures.emplace_back(
+      sycl::range(job.height + ring * 2, job.width + ring * 2) *
+      sycl::range(1, job.channels));
+  band_job widened{job, ring, blurred};
+  submit_blur<StripHeight>(widened, plan, filterBuf, inImage, plane,
+                           localRange);
+
+  // Keep the widened band's intermediates alive as long as the band.
+  job.events.insert(job.events.end(), widened.events.begin(),
+                    widened.events.end());
+  job.scratch.insert(job.scratch.end(), widened.scratch.begin(),
+                     widened.scratch.end());
+  if (widened.image) job.image = widened.image;
+  return blurred;
+}
+
+// Edge detection: the blur and the gradient magnitude of it in one
+// kernel, a blur-then-gradient chain (submit_chain_segment), so the
+// blurred band only ever lives in local memory and the band is read
+// once.  The blur runs as row and column passes when the plan has 1D
+// factors.  Only when not even a one-pixel tile of that kernel fits
+// local memory does the blur go through global memory: on the engine
+// `plan` chose, widened by the gradient's ring, then submit_gradient.
+template <int StripHeight>
+void submit_edges(band_job& job, const blur_plan& plan,
+                  sycl::buffer<float, 2>& filterBuf,
+                  const util::image_ref<pixel_t>& inImage, int plane,
+                  sycl::range<2> localRange, edge_operator op,
+                  int keepChannel) {
+  int filterWidth = plan.filter.width();
+  auto chain = filter_chain{}.blur(filterWidth / 2).gradient(op);
+  assert(job.halo == chain.padding());
+
+  auto shape = chain_shape(chain, 0, chain.size, plan.separable.has_value());
+  if (chain_tile(job.queue.get_device(), job.channels, shape)) {
+    submit_chain_segment(job, job.in, job.out, filterBuf, filterWidth,
+                         plan.separable, chain, 0, chain.size, keepChannel);
+    return;
+  }
+
+  auto blurred = submit_widened_blur<StripHeight>(job, 1, plan, filterBuf,
+                                                  inImage, plane, localRange);
+  submit_gradient(job, blurred, op, keepChannel);
+}
+
+// The morphology engine's result at picture pixel (y, x), computed
+// the slow way on the host: every pass over a patch just big enough
+// for the next, starting from samples read through `at`.
+template <typename At>
+float morphology_reference(At at, int y, int x, int filterWidth,
+                           const std::vector<morph_op>& passes) {
+  int halo = filterWidth / 2;
+  int before = halo * static_cast<int>(passes.size());
+  int size = static_cast<int>(passes.size()) * (filterWidth - 1) + 1;
+  std::vector<float> patch(size * size);
+  for (int r = 0; r < size; ++r) {
+    for (int k = 0; k < size; ++k) {
+      patch[r * size + k] = at(y - before + r, x - before + k);
+    }
+  }
+
+  // A rectangle's minimum is the minimum of its rows' minima.
+  for (auto op : passes) {
+    auto combine = [op](float a, float b) {
+      return (op == morph_op::erode) ? std::min(a, b) : std::max(a, b);
+    };
+    int next = size - (filterWidth - 1);
+    std::vector<float> rows(size * next);
+    for (int r = 0; r < size; ++r) {
+      for (int k = 0; k < next; ++k) {
+        float value = patch[r * size + k];
+        for (int d = 1; d < filterWidth; ++d) {
+          value = combine(value, patch[r * size + k + d]);
+        }
+        rows[r * next + k] = value;
+      }
+    }
+    patch.assign(next * next, 0.0f);
+    for (int r = 0; r < next; ++r) {
+      for (int k = 0; k < next; ++k) {
+        float value = rows[r * next + k];
+        for (int d = 1; d < filterWidth; ++d) {
+          value = combine(value, rows[(r + d) * next + k]);
+        }
+        patch[r * next + k] = value;
+      }
+    }
+    size = next;
+  }
+  return patch[0];
+}
+
+// A filter chain's result at picture pixel (y, x), every channel of
+// it, computed the slow way on the host as submit_chain_segment runs
+// it: each stage over a patch just big enough for the next, starting
+// from samples read through `at`.  Channel `keepChannel` goes through
+// the stencils unchanged and the point-wise stages untouched.  `error`
+// comes back as how far the device may stray from the result: every
+// stencil may add outputTolerance (and a blur its plan's
+// approximation) to the error of its input, times the stencil's gain.
+// Nothing comes back where a threshold's input lies within that error
+// of its level, since either side of it is then right.
+template <typename At>
+std::optional<std::array<double, 4>> chain_reference(
+    At at, int y, int x, int channels, const std::vector<blur_plan>& plans,
+    bool planar, const filter_chain& chain, int keepChannel, double& error) {
+  using sample = std::array<double, 4>;
+  int before = chain.padding();
+  int size = 2 * before + 1;
+  std::vector<sample> patch(size * size);
+  for (int r = 0; r < size; ++r) {
+    for (int k = 0; k < size; ++k) {
+      for (int i = 0; i < channels; ++i) {
+        patch[r * size + k][i] = at(y - before + r, x - before + k, i);
+      }
+    }
+  }
+
+  error = 0.0;
+  for (int s = 0; s < chain.size; ++s) {
+    const auto& stage = chain.stages[s];
+    if (!stage.stencil()) {
+      for (auto& value : patch) {
+        if (stage.kind == stage_kind::grayscale && channels >= 3) {
+          double luma =
+              0.299 * value[0] + 0.587 * value[1] + 0.114 * value[2];
+          value[0] = value[1] = value[2] = luma;
+        }
+        for (int i = 0; i < channels; ++i) {
+          if (i == keepChannel) continue;
+          if (stage.kind == stage_kind::threshold) {
+            if (std::fabs(value[i] - stage.level) <= error) return std::nullopt;
+            value[i] = (value[i] >= stage.level) ? 255.0 : 0.0;
+          } else if (stage.kind == stage_kind::scale) {
+            value[i] = value[i] * stage.factor + stage.offset;
+          }
+        }
+      }
+      if (stage.kind == stage_kind::threshold) error = 0.0;
+      if (stage.kind == stage_kind::scale) error *= std::fabs(stage.factor);
+      continue;
+    }
+
+    int padding = stage.padding();
+    int next = size - 2 * padding;
+    // A gradient component is off by at most twice its samples' error.
+    double gain = 2.0 * std::sqrt(2.0);
+    double approximation = 0.0;
+    if (stage.kind == stage_kind::blur) {
+      gain = 0.0;
+      for (int i = 0; i < channels; ++i) {
+        if (i == keepChannel) continue;
+        auto& plan = plans[planar ? i : 0];
+        auto& filter = plan.filter;
+        assert(filter.width() == 2 * padding + 1);
+        double taps = 0.0;
+        for (int t = 0; t < filter.width() * filter.width(); ++t) {
+          taps += std::fabs(filter.data()[t * filter.channels() +
+                                          (planar ? 0 : i)]);
+        }
+        gain = std::max(gain, taps);
+        approximation = std::max<double>(approximation, plan.approximation);
+      }
+    }
+
+    std::vector<sample> result(next * next);
+    for (int r = 0; r < next; ++r) {
+      for (int k = 0; k < next; ++k) {
+        for (int i = 0; i < channels; ++i) {
+          auto in = [&](int dy, int dx) {
+            return patch[(r + padding + dy) * size + k + padding + dx][i];
+          };
+          double value = in(0, 0);
+          if (i != keepChannel && stage.kind == stage_kind::blur) {
+            auto& filter = plans[planar ? i : 0].filter;
+            int width = filter.width();
+            value = 0.0;
+            for (int fr = 0; fr < width; ++fr) {
+              for (int fc = 0; fc < width; ++fc) {
+                value += in(fr - padding, fc - padding) *
+                         filter.data()[(fr * width + fc) * filter.channels() +
+                                       (planar ? 0 : i)];
+              }
+            }
+          } else if (i != keepChannel) {
+            double side = (stage.op == edge_operator::scharr) ? 3.0 : 1.0;
+            double middle = (stage.op == edge_operator::scharr) ? 10.0 : 2.0;
+            double gx = side * (in(-1, 1) - in(-1, -1)) +
+                        middle * (in(0, 1) - in(0, -1)) +
+                        side * (in(1, 1) - in(1, -1));
+            double gy = side * (in(1, -1) - in(-1, -1)) +
+                        middle * (in(1, 0) - in(-1, 0)) +
+                        side * (in(1, 1) - in(-1, 1));
+            value = std::min(
+                std::sqrt(gx * gx + gy * gy) / (2.0 * side + middle), 255.0);
+          }
+          result[r * next + k][i] = value;
+        }
+      }
+    }
+    patch = std::move(result);
+    size = next;
+    error = error * gain + outputTolerance + approximation;
+  }
+
+  if (std::is_same_v<pixel_t, unsigned char>) {
+    for (int i = 0; i < channels; ++i) {
+      patch[0][i] = std::clamp(patch[0][i], 0.0, 255.0);
+    }
+  }
+  return patch[0];
+}
+
+// Largest difference between the device output and a double precision
+// convolution on the host, over a grid of about 16 x 16 pixels of the
+// first `rows` rows (a bilateral filter, for plans with range weights,
+// a median or morphology for those engines).
+// Cheap enough to run on every picture, and it checks whichever
+// engines and sample type did the work.
+double sampled_error(const util::image_ref<pixel_t>& inImage,
+                     const util::image_ref<pixel_t>& outImage,
+                     const std::vector<blur_plan>& plans, int rows) {
+  bool planar = (inImage.layout() == util::image_layout::planar);
+  int stepY = std::max(1, rows / 16);
+  int stepX = std::max(1, inImage.width() / 16);
+  double worst = 0.0;
+
+  for (int c = 0; c < inImage.channels(); ++c) {
+    auto& plan = plans[planar ? c : 0];
+    auto& filter = plan.filter;
+    auto& rangeWeights = plan.rangeWeights;
+    int filterChannel = planar ? 0 : c;
+    int filterWidth = filter.width();
+    int filterHalo = filter.half_width();
+
+    // Clamp-to-edge sample of the picture at (row, column), whether or
+    // not the image carries padding.
+    auto at = [&](int row, int column) -> float {
+      row = std::clamp(row, 0, inImage.height() - 1) + inImage.halo();
+      column = std::clamp(column, 0, inImage.width() - 1) + inImage.halo();
+      return inImage.data()[inImage.index(row, column, c)];
+    };
+
+    for (int y = stepY / 2; y < rows; y += stepY) {
+      for (int x = stepX / 2; x < inImage.width(); x += stepX) {
+        double sum = 0.0;
+        double total = 0.0;
+        float centre = at(y, x);
+        for (int r = 0; r < filterWidth; ++r) {
+          for (int k = 0; k < filterWidth; ++k) {
+            float value = at(y + r - filterHalo, x + k - filterHalo);
+            double weight = filter.data()[((r * filterWidth) + k) *
+                                              filter.channels() +
+                                          filterChannel];
+            if (!rangeWeights.empty()) {
+              int level = std::min(
+                  static_cast<int>(std::fabs(value - centre) + 0.5f),
+                  static_cast<int>(rangeWeights.size()) - 1);
+              weight *= rangeWeights[level];
+            }
+            sum += value * weight;
+            total += weight;
+          }
+        }
+        if (!rangeWeights.empty()) sum /= total;
+        if (plan.copiedChannels & (1 << filterChannel)) {
+          sum = centre;
+        } else if (plan.engine == blur_engine::median) {
+          std::vector<int> levels;
+          for (int r = 0; r < filterWidth; ++r) {
+            for (int k = 0; k < filterWidth; ++k) {
+              float value = at(y + r - filterHalo, x + k - filterHalo);
+              levels.push_back(std::clamp(
+                  static_cast<int>(std::round(value)), 0, 255));
+            }
+          }
+          auto median = levels.begin() + levels.size() / 2;
+          std::nth_element(levels.begin(), median, levels.end());
+          sum = *median;
+        } else if (!plan.morphology.empty()) {
+          sum = morphology_reference(at, y, x, filterWidth, plan.morphology);
+        } else {
+          sum = blur_result<double>(sum, centre);
+          if (std::is_same_v<pixel_t, unsigned char>) {
+            sum = std::clamp(sum, 0.0, 255.0);
+          }
+        }
+        float got = outImage.data()[outImage.index(y, x, c)];
+        worst = std::max(worst, std::fabs(got - sum));
+      }
+    }
+  }
+  return worst;
+}
+
+// Largest difference between the device output of a filter chain (or
+// of edge detection, a blur-then-gradient chain) and chain_reference,
+// over the same grid as sampled_error, with in `bound` how far it may
+// be.  Samples whose thresholds chain_reference cannot call are
+// skipped.
+double sampled_chain_error(const util::image_ref<pixel_t>& inImage,
+                           const util::image_ref<pixel_t>& outImage,
+                           const std::vector<blur_plan>& plans,
+                           const filter_chain& chain, int rows, float& bound) {
+  bool planar = (inImage.layout() == util::image_layout::planar);
+  int channels = inImage.channels();
+  int keepChannel = (channels == 4) ? 3 : -1;
+  int stepY = std::max(1, rows / 16);
+  int stepX = std::max(1, inImage.width() / 16);
+  double worst = 0.0;
+  double error = 0.0;
+
+  auto at = [&](int row, int column, int c) -> float {
+    row = std::clamp(row, 0, inImage.height() - 1) + inImage.halo();
+    column = std::clamp(column, 0, inImage.width() - 1) + inImage.halo();
+    return inImage.data()[inImage.index(row, column, c)];
+  };
+
+  for (int y = stepY / 2; y < rows; y += stepY) {
+    for (int x = stepX / 2; x < inImage.width(); x += stepX) {
+      auto expected = chain_reference(at, y, x, channels, plans, planar, chain,
+                                      keepChannel, error);
+      if (!expected) continue;
+      for (int c = 0; c < channels; ++c) {
+        float got = outImage.data()[outImage.index(y, x, c)];
+        worst = std::max(worst, std::fabs(got - (*expected)[c]));
+      }
+    }
+  }
+  bound = static_cast<float>(error) + outputTolerance;
+  return worst;
+}
+
 int main(int argc, char* argv[]) {
   const char* inFile = argv[1];
+  // An optional filter file replaces the generated filter's taps.
+  const char* filterFile = (argc == 3) ? argv[2] : nullptr;
   char* outFile;
 
-  if (argc == 2) {
+  if (argc == 2 || argc == 3) {
     if (strchr(inFile, '/') || strchr(inFile, '\\')) {
       std::cerr << "Sorry, filename cannot include a path.\n";
       exit(1);
@@ -61,16 +3462,59 @@ int main(int argc, char* argv[]) {
 #ifdef MYDEBUGS
     std::cout << "Input file: " << inFile << "\nOutput file: " << outFile
               << "\n";
+    if (filterFile) std::cout << "Filter file: " << filterFile << "\n";
 #endif
   } else {
-    std::cerr << "Usage: " << argv[0] << " imagefile\n";
+    std::cerr << "Usage: " << argv[0] << " imagefile [filterfile]\n";
     exit(1);
   }
-
-  auto inImage = util::read_image(inFile, halo);
-
-  auto outImage = util::allocate_image(inImage.width(), inImage.height(),
-                                       inImage.channels());
+  // The loaded taps are convolved with, so they can only stand in for
+  // a convolution's.
+  if (filterFile && !linearFilter) {
+    std::cerr << "A filter file needs a convolution filterType.\n";
+    exit(1);
+  }
+  // A filter chain's padding is fixed by the generated filter.
+  if (filterFile && chained) {
+    std::cerr << "A filter chain blurs with the generated filter.\n";
+    exit(1);
+  }
+  std::optional<util::image_ref<float>> kernel;
+  if (filterFile) kernel.emplace(util::load_kernel(filterFile));
+
+  // Gradients need a ring of blurred pixels around each band, so that
+  // much more padding than the blur: one pixel for the edge operators,
+  // two for Canny, whose thinning compares gradients one pixel further
+  // out.  An opening or a closing is two passes over the picture, each
+  // using up a halo.  A filter chain needs the padding of all its
+  // stencils.  A loaded kernel pads with its own half width, so the
+  // engines do the work of its real size.  The recursive engine pads by
+  // how far its recursion takes to settle; where gaussian_iir's taps
+  // are convolved instead (edge detection) they pad by their half
+  // width, which iirSigma sets.  Canny always smooths with a Gaussian,
+  // whatever filterType says, so the halo follows the blur that runs.
+  constexpr auto blurType = canny ? util::filter_type::gaussian : filterType;
+  constexpr bool edges = (edgeOperator != edge_operator::none);
+  constexpr int passes = (blurType == util::filter_type::opening ||
+                          blurType == util::filter_type::closing)
+                             ? 2
+                             : 1;
+  constexpr int gradientRing = edges ? 1 : canny ? 2 : 0;
+  constexpr bool iirTaps = blurType == util::filter_type::gaussian_iir;
+  const bool recursive = iirTaps && !edges && !kernel;
+  const int filterHalo = iirTaps ? util::gaussian_width(iirSigma) / 2 : halo;
+  const int bandHalo =
+      chained     ? filterChain.padding()
+      : kernel    ? kernel->half_width() * passes + gradientRing
+      : recursive ? iir_settle_length(iirSigma)
+                  : filterHalo * passes + gradientRing;
+
+  auto inImage =
+      util::read_image<pixel_t>(inFile, padOnDevice ? 0 : bandHalo, padToRgba,
+                                imageLayout);
+
+  auto outImage = util::allocate_image<pixel_t>(
+      inImage.width(), inImage.height(), inImage.channels(), imageLayout);
 
   // The image convolution support code provides a
   // `filter_type` enum which allows us to choose between
@@ -78,8 +3522,27 @@ int main(int argc, char* argv[]) {
   // filter data; `generate_filter` takes a `filter_type`
   // and a width.
 
-  auto filter = util::generate_filter(util::filter_type::blur, filterWidth,
-                                      inImage.channels());
+  // Gaussians are generated by sigma, filterWidth / 6 here so that they
+  // fit the halo read_image padded with, and gaussian_iir's by iirSigma.
+  // Canny always smooths with one (blurType, above).
+  auto sigma = util::gaussian_sigma(filterWidth);
+  // A kernel from a file is convolved as it is: plan_blur's rank test
+  // decides between the two 1D passes and the 2D engines.
+  auto filter =
+      kernel ? util::kernel_filter(*kernel, inImage.channels())
+      : (blurType == util::filter_type::gaussian)
+          ? util::generate_gaussian(sigma, inImage.channels(), filterWidth)
+      : (blurType == util::filter_type::gaussian_iir)
+          ? util::generate_gaussian(iirSigma, inImage.channels())
+          : util::generate_filter(blurType, filterWidth, inImage.channels());
+  auto planType = filterFile ? util::filter_type::blur : blurType;
+
+  // A Gaussian comes with its 1D factor, which sends it straight to the
+  // separable engine: 2 * filterWidth taps per pixel, not filterWidth^2.
+  std::optional<util::separable_filter> factors;
+  if (blurType == util::filter_type::gaussian && !filterFile) {
+    factors = util::gaussian_factors(sigma, inImage.channels(), filterWidth);
+  }
 
 
   //
@@ -122,6 +3585,7 @@ int main(int argc, char* argv[]) {
   }
 #endif
 
+  bool outOfBound = false;  // see the sampled_error check below
   try {
     sycl::queue myQueue1 = myQueues[0];
 
@@ -218,41 +3682,38 @@ int main(int argc, char* argv[]) {
   auto channels = inImage.channels();
   auto filterWidth = filter.width();
   auto halo = filter.half_width();
+  assert(chained || (recursive ? iir_settle_length(iirSigma)
+                               : halo * passes + gradientRing) == bandHalo);
+  assert(bandHalo == inImage.halo() || inImage.halo() == 0);
 
-  auto globalRange_a = sycl::range(inImgWidth, inImgHeight_a);
-  auto globalRange_b = sycl::range(inImgWidth, inImgHeight_b);
-  auto globalRange_c = sycl::range(inImgWidth, inImgHeight_c);
-//  auto globalRange_d = sycl::range(inImgWidth, inImgHeight_d);
   auto localRange = sycl::range(1, 8);    // It seems Intel have 8 "threads" per "warp"
+  constexpr int stripHeight = 4;          // output rows per work-item, blocked kernel
+
+  // A planar image is blurred one plane at a time, each plane being a
+  // single-channel image with its own channel of the filter.
+  bool planar = (inImage.layout() == util::image_layout::planar);
+  for (int k = 0; k < filterChain.size; ++k) {
+    if (planar && filterChain.stages[k].kind == stage_kind::grayscale) {
+      std::cerr << "A grayscale stage needs the interleaved layout.\n";
+      exit(1);
+    }
+  }
 
-  auto ndRange_a = sycl::nd_range(globalRange_a, localRange);
-  auto ndRange_b = sycl::nd_range(globalRange_b, localRange);
-  auto ndRange_c = sycl::nd_range(globalRange_c, localRange);
-//  auto ndRange_d = sycl::nd_range(globalRange_d, localRange);
-
-  auto inBufRange_a =
-      sycl::range(inImgHeight_a + (halo * 2), inImgWidth + (halo * 2)) *
-      sycl::range(1, channels);
-  auto inBufRange_b =
-      sycl::range(inImgHeight_b + (halo * 2), inImgWidth + (halo * 2)) *
-      sycl::range(1, channels);
-  auto inBufRange_c =
-      sycl::range(inImgHeight_c + (halo * 2), inImgWidth + (halo * 2)) *
-      sycl::range(1, channels);
-/* auto inBufRange_d =
-      sycl::range(inImgHeight_d + (halo * 2), inImgWidth + (halo * 2)) *
-      sycl::range(1, channels); */
-
-  auto outBufRange_a =
-      sycl::range(inImgHeight_a, inImgWidth) * sycl::range(1, channels);
-  auto outBufRange_b =
-      sycl::range(inImgHeight_b, inImgWidth) * sycl::range(1, channels);
-  auto outBufRange_c =
-      sycl::range(inImgHeight_c, inImgWidth) * sycl::range(1, channels);
-/*  auto outBufRange_d =
-      sycl::range(inImgHeight_d, inImgWidth) * sycl::range(1, channels); */
-
-  auto filterRange = filterWidth * sycl::range(1, channels);
+  std::vector<blur_plan> plans;
+  if (planar) {
+    for (int c = 0; c < channels; ++c) {
+      std::optional<util::separable_filter> planeFactors;
+      if (factors) {
+        planeFactors = util::filter_channel(*factors, channels, c);
+      }
+      plans.push_back(plan_blur(util::filter_channel(filter, c), planType,
+                                inImgWidth, inImgHeight_tot,
+                                std::move(planeFactors)));
+    }
+  } else {
+    plans.push_back(plan_blur(std::move(filter), planType, inImgWidth,
+                              inImgHeight_tot, std::move(factors)));
+  }
 
 
 #ifdef MYDEBUGS
@@ -260,7 +3721,46 @@ int main(int argc, char* argv[]) {
             << "\ninImgHeight_a: " << inImgHeight_a << "\ninImgHeight_b: " << inImgHeight_b
             << "\ninImgHeight_c: " << inImgHeight_c 
             << "\nchannels: " << channels << "\nfilterWidth: " << filterWidth
-            << "\nhalo: " << halo << "\n";
+            << "\nhalo: " << halo
+            << "\nlayout: " << (planar ? "planar" : "interleaved")
+            << "\nedges: "
+            << (canny                                   ? "canny"
+                : edgeOperator == edge_operator::sobel  ? "sobel"
+                : edgeOperator == edge_operator::scharr ? "scharr"
+                                                        : "none")
+            << "\nunsharp amount: " << (unsharpMask ? unsharpAmount : 0.0f)
+            << "\nchain:";
+  // Kernels of the filter chain on the first queue's device, split by
+  // |; the plain filter's engine when there is no chain, or how edge
+  // detection blurs in its one kernel.
+  if (chained) {
+    auto starts = chain_segments(myQueue1.get_device(), planar ? 1 : channels,
+                                 filterChain, plans[0].separable.has_value());
+    for (std::size_t s = 0; s + 1 < starts.size(); ++s) {
+      if (s > 0) std::cout << " |";
+      for (int k = starts[s]; k < starts[s + 1]; ++k) {
+        std::cout << " " << stage_name(filterChain.stages[k].kind);
+      }
+    }
+    std::cout << "\nchain blur: "
+              << (plans[0].separable ? "row and column passes" : "direct")
+              << "\n";
+  } else if (edges) {
+    std::cout << " none\nengine: blur and gradient in one kernel, the blur "
+              << (plans[0].separable ? "as row and column passes" : "direct")
+              << "\n";
+  } else {
+    std::cout << " none\nengine:";
+    for (auto& plan : plans) std::cout << " " << engine_name(plan.engine);
+    std::cout << "\n";
+    for (auto& plan : plans) {
+      if (plan.engine != blur_engine::low_rank) continue;
+      int terms = static_cast<int>(plan.lowRank->row.size()) /
+                  (plan.filter.width() * plan.filter.channels());
+      std::cout << "low rank: " << terms << " terms, within "
+                << plan.approximation << " levels\n";
+    }
+  }
 #endif
 
 
@@ -275,151 +3775,89 @@ int main(int argc, char* argv[]) {
 
   {
     // ======== Picture blurring submit begin ==========
-    auto inBuf_a = sycl::buffer{inImage.data(), inBufRange_a};
-    auto outBuf_a = sycl::buffer<float, 2>{outBufRange_a};
-    outBuf_a.set_final_data(outImage.data());
-
-    auto inBuf_b = sycl::buffer{inImage.data() + inImgHeight_a * channels * (inImgWidth + halo * 2), inBufRange_b};
-    auto outBuf_b = sycl::buffer<float, 2>{outBufRange_b};
-    outBuf_b.set_final_data(outImage.data() + inImgHeight_a * channels * inImgWidth);
-
-    auto inBuf_c = sycl::buffer{inImage.data() + (inImgHeight_a + inImgHeight_b) * channels * (inImgWidth + halo * 2),
-                     inBufRange_c};
-    auto outBuf_c = sycl::buffer<float, 2>{outBufRange_c};
-    outBuf_c.set_final_data(outImage.data() + (inImgHeight_a + inImgHeight_b) * channels * inImgWidth);
+    // Jobs are dealt round-robin to myQueue1, myQueue3, myQueue4: the
+    // three bands of an interleaved image, or the planes of a planar
+    // one (R, G, B one per queue), each plane whole.
+    std::array<sycl::queue, 3> slotQueues{myQueue1, myQueue3, myQueue4};
+
+    int bandRows = inImgHeight_a + inImgHeight_b + inImgHeight_c;
+    std::vector<band_job> bands;
+    if (planar) {
+      bands.reserve(channels);
+      for (int c = 0; c < channels; ++c) {
+        bands.emplace_back(slotQueues[c % 3], inImage, outImage, bandHalo, 0,
+                           bandRows, c);
+      }
+    } else {
+      bands.reserve(3);
+      bands.emplace_back(myQueue1, inImage, outImage, bandHalo, 0,
+                         inImgHeight_a);
+      bands.emplace_back(myQueue3, inImage, outImage, bandHalo, inImgHeight_a,
+                         inImgHeight_b);
+      bands.emplace_back(myQueue4, inImage, outImage, bandHalo,
+                         inImgHeight_a + inImgHeight_b, inImgHeight_c);
+    }
 
-    auto filterBuf = sycl::buffer{filter.data(), filterRange};
+    std::vector<sycl::buffer<float, 2>> filterBufs;
+    for (auto& plan : plans) {
+      filterBufs.emplace_back(
+          static_cast<const float*>(plan.filter.data()),
+          filterWidth * sycl::range(1, plan.filter.channels()));
+    }
 
 #ifdef MYDEBUGS
     auto t1_start = std::chrono::steady_clock::now();  // Start timing
 #endif
 
-    sycl::event e1 = myQueue1.submit([&](sycl::handler& cgh1) {
-      sycl::accessor inAccessor{inBuf_a, cgh1, sycl::read_only};
-      sycl::accessor outAccessor{outBuf_a, cgh1, sycl::write_only};
-      sycl::accessor filterAccessor{filterBuf, cgh1, sycl::read_only};
-
-      cgh1.parallel_for(ndRange_a, [=](sycl::nd_item<2> item) {
-        auto globalId = item.get_global_id();
-        globalId = sycl::id{globalId[1], globalId[0]};
-
-        auto channelsStride = sycl::range(1, channels);
-        auto haloOffset = sycl::id(halo, halo);
-        auto src = (globalId + haloOffset) * channelsStride;
-        auto dest = globalId * channelsStride;
-
-        // 100 is a hack - so the dim is not dynamic
-        float sum[/* channels */ 100];
-        assert(channels < 100);
-
-        for (size_t i = 0; i < channels; ++i) {
-          sum[i] = 0.0f;
-        }
-
-        for (int r = 0; r < filterWidth; ++r) {
-          for (int c = 0; c < filterWidth; ++c) {
-            auto srcOffset =
-                sycl::id(src[0] + (r - halo), src[1] + ((c - halo) * channels));
-            auto filterOffset = sycl::id(r, c * channels);
-
-            for (int i = 0; i < channels; ++i) {
-              auto channelOffset = sycl::id(0, i);
-              sum[i] += inAccessor[srcOffset + channelOffset] *
-                        filterAccessor[filterOffset + channelOffset];
-            }
-          }
-        }
-
-        for (size_t i = 0; i < channels; ++i) {
-          outAccessor[dest + sycl::id{0, i}] = sum[i];
-        }
-      });
-    });
-
-
-    sycl::event e3 = myQueue3.submit([&](sycl::handler& cgh1) {
-      sycl::accessor inAccessor{inBuf_b, cgh1, sycl::read_only};
-      sycl::accessor outAccessor{outBuf_b, cgh1, sycl::write_only};
-      sycl::accessor filterAccessor{filterBuf, cgh1, sycl::read_only};
-
-      cgh1.parallel_for(ndRange_b, [=](sycl::nd_item<2> item) {
-        auto globalId = item.get_global_id();
-        globalId = sycl::id{globalId[1], globalId[0]};
-
-        auto channelsStride = sycl::range(1, channels);
-        auto haloOffset = sycl::id(halo, halo);
-        auto src = (globalId + haloOffset) * channelsStride;
-        auto dest = globalId * channelsStride;
-
-        // 100 is a hack - so the dim is not dynamic
-        float sum[100];
-        assert(channels < 100);
-
-        for (size_t i = 0; i < channels; ++i) {
-          sum[i] = 0.0f;
-        }
-
-        for (int r = 0; r < filterWidth; ++r) {
-          for (int c = 0; c < filterWidth; ++c) {
-            auto srcOffset =
-                sycl::id(src[0] + (r - halo), src[1] + ((c - halo) * channels));
-            auto filterOffset = sycl::id(r, c * channels);
-
-            for (int i = 0; i < channels; ++i) {
-              auto channelOffset = sycl::id(0, i);
-              sum[i] += inAccessor[srcOffset + channelOffset] *
-                        filterAccessor[filterOffset + channelOffset];
-            }
-          }
-        }
-
-        for (size_t i = 0; i < channels; ++i) {
-          outAccessor[dest + sycl::id{0, i}] = sum[i];
-        }
-      });
-    });
-
-    sycl::event e4 = myQueue4.submit([&](sycl::handler& cgh1) {
-      sycl::accessor inAccessor{inBuf_c, cgh1, sycl::read_only};
-      sycl::accessor outAccessor{outBuf_c, cgh1, sycl::write_only};
-      sycl::accessor filterAccessor{filterBuf, cgh1, sycl::read_only};
-
-      cgh1.parallel_for(ndRange_c, [=](sycl::nd_item<2> item) {
-        auto globalId = item.get_global_id();
-        globalId = sycl::id{globalId[1], globalId[0]};
-
-        auto channelsStride = sycl::range(1, channels);
-        auto haloOffset = sycl::id(halo, halo);
-        auto src = (globalId + haloOffset) * channelsStride;
-        auto dest = globalId * channelsStride;
-
-        // 100 is a hack - so the dim is not dynamic
-        float sum[100];
-        assert(channels < 100);
-
-        for (size_t i = 0; i < channels; ++i) {
-          sum[i] = 0.0f;
-        }
-
-        for (int r = 0; r < filterWidth; ++r) {
-          for (int c = 0; c < filterWidth; ++c) {
-            auto srcOffset =
-                sycl::id(src[0] + (r - halo), src[1] + ((c - halo) * channels));
-            auto filterOffset = sycl::id(r, c * channels);
-
-            for (int i = 0; i < channels; ++i) {
-              auto channelOffset = sycl::id(0, i);
-              sum[i] += inAccessor[srcOffset + channelOffset] *
-                        filterAccessor[filterOffset + channelOffset];
-            }
-          }
-        }
+    // The channel of band i that edge detection leaves blurred (the
+    // alpha of RGBA), or -1.
+    auto keptChannel = [&](std::size_t i) {
+      return (channels != 4) ? -1 : planar ? (i == 3 ? 0 : -1) : 3;
+    };
+
+    for (std::size_t i = 0; i < bands.size(); ++i) {
+      auto& band = bands[i];
+      auto& plan = plans[planar ? i : 0];
+      auto& filterBuf = filterBufs[planar ? i : 0];
+
+      // The sampled-image engine clamps in its sampler instead, or on
+      // a device without images pads the input itself, also for a
+      // widened job (Canny).  Edge detection and chains read band.in.
+      if (band.source &&
+          (edges || chained || plan.engine != blur_engine::sampled_image)) {
+        submit_clamp_to_edge(band);
+      }
+
+      if (chained) {
+        submit_chain(band, filterBuf, filterWidth, plan.separable,
+                     filterChain, keptChannel(i));
+        continue;
+      }
+
+      if (edges) {
+        submit_edges<stripHeight>(band, plan, filterBuf, inImage,
+                                  planar ? i : 0, localRange, edgeOperator,
+                                  keptChannel(i));
+      } else if (canny) {
+        auto blurred = submit_widened_blur<stripHeight>(
+            band, 2, plan, filterBuf, inImage, planar ? i : 0, localRange);
+        submit_canny_classes(band, blurred, bandRows, cannyLow, cannyHigh,
+                             keptChannel(i));
+      } else {
+        submit_blur<stripHeight>(band, plan, filterBuf, inImage,
+                                 planar ? i : 0, localRange);
+      }
+    }
 
-        for (size_t i = 0; i < channels; ++i) {
-          outAccessor[dest + sycl::id{0, i}] = sum[i];
-        }
-      });
-    });
+    if (canny) {
+      [[maybe_unused]] int sweeps = canny_hysteresis(bands);
+      for (std::size_t i = 0; i < bands.size(); ++i) {
+        submit_canny_edges(bands[i], keptChannel(i));
+      }
+#ifdef MYDEBUGS
+      std::cout << "hysteresis sweeps: " << sweeps << "\n";
+#endif
+    }
 
 
 
@@ -528,18 +3966,9 @@ int main(int argc, char* argv[]) {
     //           << " nanoseconds (" << time2C / 1.0e9 << " seconds)\n";
 
 
-    double time1A = (e1.template get_profiling_info<
-                         sycl::info::event_profiling::command_end>() -
-                     e1.template get_profiling_info<
-                         sycl::info::event_profiling::command_start>());
-    double time1B = (e3.template get_profiling_info<
-                         sycl::info::event_profiling::command_end>() -
-                     e3.template get_profiling_info<
-                         sycl::info::event_profiling::command_start>());
-    double time1C = (e4.template get_profiling_info<
-                         sycl::info::event_profiling::command_end>() -
-                     e4.template get_profiling_info<
-                         sycl::info::event_profiling::command_start>());
+    double time1A = slot_time(bands, 0);
+    double time1B = slot_time(bands, 1);
+    double time1C = slot_time(bands, 2);
 
     double time1E =
         (std::chrono::duration_cast<std::chrono::microseconds>(t1_end - t1_start)
@@ -579,10 +4008,47 @@ int main(int argc, char* argv[]) {
 
 #endif
   }
+
+  // The buffers are gone, so outImage holds the device results.  A
+  // plain blur is checked against the filter's taps, edge detection and
+  // filter chains against the same stages run on the host; a result
+  // off by more than the bound still gets written, for a look, but the
+  // run fails.  Canny's hysteresis follows edges across the whole
+  // picture, which no sample can, so its output goes unchecked.
+  if (canny) {
+    std::cerr << "Canny output is not checked against a host reference.\n";
+  } else {
+    int rows = inImgHeight_a + inImgHeight_b + inImgHeight_c;
+    double error;
+    float bound = outputTolerance;
+    if (edges || chained) {
+      auto chain = chained ? filterChain
+                           : filter_chain{}
+                                 .blur(plans[0].filter.width() / 2)
+                                 .gradient(edgeOperator);
+      error = sampled_chain_error(inImage, outImage, plans, chain, rows, bound);
+    } else {
+      error = sampled_error(inImage, outImage, plans, rows);
+      for (auto& plan : plans) {
+        bound = std::max(bound, outputTolerance + plan.approximation);
+      }
+      // Sharpening scales the blur's error up with it.
+      if (unsharpMask) bound *= 1.0f + unsharpAmount;
+    }
+#ifdef MYDEBUGS
+    std::cout << "max sampled error: " << error << " (bound " << bound << ")\n";
+#endif
+    if (error > bound) {
+      std::cerr << "Output is off by more than the bound for its sample "
+                   "type and engine.\n";
+      outOfBound = true;
+    }
+  }
 }
 catch (sycl::exception e) {
   std::cout << "Exception caught: " << e.what() << std::endl;
 }
 
-util::write_image(outImage, outFile);
+util::write_image(outImage, outFile, util::image_channels(inFile));
+if (outOfBound) exit(1);
 }
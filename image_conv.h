@@ -9,6 +9,16 @@
 #ifndef __IMAGE_CONV_H__
 #define __IMAGE_CONV_H__
 
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -18,18 +28,88 @@ namespace util {
 
 enum class filter_type {
   identity,
-  blur
+  blur,
+  gaussian,
+  gaussian_iir,
+  bilateral,
+  median,
+  erode,
+  dilate,
+  opening,
+  closing
+};
+
+// Standard deviation of the Gaussian a filter of `width` taps stands
+// for: the taps reach out to 3 sigma on either side.
+float gaussian_sigma(int width) { return width / 6.0f; }
+
+// Width that reaches out to 3 sigma on either side of a centre tap,
+// so it is odd and the halo is width / 2 on both sides.
+int gaussian_width(float sigma) {
+  return 2 * std::max(1, static_cast<int>(std::ceil(3.0f * sigma))) + 1;
+}
+
+// `width` samples of a Gaussian centred on tap width / 2 (the tap the
+// kernels line up with the output pixel), normalized to sum to 1.  An
+// even width has one more tap before the centre than after it; that
+// tap stays 0, so the blur is symmetric and doesn't shift the picture.
+std::vector<float> gaussian_taps(int width, float sigma) {
+  std::vector<float> taps(width, 0.0f);
+  int radius = (width - 1) / 2;
+  float sum = 0.0f;
+  for (int k = width / 2 - radius; k < width; ++k) {
+    float offset = static_cast<float>(k - (width / 2));
+    taps[k] = std::exp(-(offset * offset) / (2.0f * sigma * sigma));
+    sum += taps[k];
+  }
+  for (auto& tap : taps) tap /= sum;
+  return taps;
+}
+
+// Range weights of a bilateral filter: entry d weighs a neighbour that
+// differs from the centre pixel by d levels, a Gaussian of standard
+// deviation `sigma` levels.
+std::vector<float> range_weights(float sigma, int levels = 256) {
+  std::vector<float> weights(levels);
+  for (int d = 0; d < levels; ++d) {
+    weights[d] = std::exp(-(d * d) / (2.0f * sigma * sigma));
+  }
+  return weights;
+}
+
+// How the channels of an image are laid out in memory: interleaved
+// (HWC, every pixel's channels next to each other, as stb delivers
+// them) or planar (CHW, one padded height x width plane per channel).
+enum class image_layout {
+  interleaved,
+  planar
 };
 
 template <typename T>
 class image_ref {
  public:
-  image_ref(T* imageData, int width, int height, int channels, int halo)
+  image_ref(T* imageData, int width, int height, int channels, int halo,
+            image_layout layout = image_layout::interleaved)
       : imageData_{imageData},
         width_{width},
         height_{height},
         channels_{channels},
-        halo_{halo} {}
+        halo_{halo},
+        layout_{layout} {}
+
+  // Owns its data, so it can be moved but not copied.
+  image_ref(const image_ref&) = delete;
+  image_ref& operator=(const image_ref&) = delete;
+
+  image_ref(image_ref&& other) noexcept
+      : imageData_{other.imageData_},
+        width_{other.width_},
+        height_{other.height_},
+        channels_{other.channels_},
+        halo_{other.halo_},
+        layout_{other.layout_} {
+    other.imageData_ = nullptr;
+  }
 
   ~image_ref() { delete[] imageData_; }
 
@@ -43,21 +123,45 @@ class image_ref {
 
   int halo() const noexcept { return halo_; }
 
+  image_layout layout() const noexcept { return layout_; }
+
   int count() const noexcept { return width_ * height_; }
 
   int size() const noexcept { return width_ * height_ * channels_; }
 
   int half_width() const noexcept { return width_ / 2; }
 
+  // Elements in one channel plane of a planar image, halo included.
+  int plane_size() const noexcept {
+    return (width_ + (halo_ * 2)) * (height_ + (halo_ * 2));
+  }
+
+  // Offset of channel `c` of padded pixel (i, j) in data().
+  int index(int i, int j, int c) const noexcept {
+    int widthWithPadding = width_ + (halo_ * 2);
+    return layout_ == image_layout::planar
+               ? (c * plane_size()) + (i * widthWithPadding) + j
+               : (((i * widthWithPadding) + j) * channels_) + c;
+  }
+
  private:
   T* imageData_ = nullptr;
   int width_ = 0;
   int height_ = 0;
   int channels_ = 0;
   int halo_ = 0;
+  image_layout layout_ = image_layout::interleaved;
 };
 
-image_ref<float> read_image(std::string imageFile, int halo) {
+// Loads an 8-bit image as T samples (floats by default, or the bytes
+// as they are) with `halo` pixels of clamp-to-edge
+// padding on every side.  With padToRgba an RGB image comes back with
+// a fourth, opaque channel, so whole pixels line up with
+// sycl::vec<float, 4>.  A planar image pads each plane separately.
+template <typename T = float>
+image_ref<T> read_image(
+    std::string imageFile, int halo, bool padToRgba = false,
+    image_layout layout = image_layout::interleaved) {
   int width = 0, height = 0, channels = 0;
   unsigned char* inputData =
       stbi_load(imageFile.c_str(), &width, &height, &channels, 0);
@@ -74,9 +178,13 @@ image_ref<float> read_image(std::string imageFile, int halo) {
   int widthWithPadding = width + (halo * 2);
   int heightWithPadding = height + (halo * 2);
 
+  int fileChannels = channels;
+  if (padToRgba && channels == 3) channels = 4;
+
   int sizeWithPadding = (width + (halo * 2)) * (height + (halo * 2)) * channels;
 
-  float* imageData = new float[sizeWithPadding];
+  T* imageData = new T[sizeWithPadding];
+  image_ref<T> image{imageData, width, height, channels, halo, layout};
 
   for (int i = 0; i < (heightWithPadding); ++i) {
     for (int j = 0; j < (widthWithPadding); ++j) {
@@ -87,34 +195,80 @@ image_ref<float> read_image(std::string imageFile, int halo) {
         srcJ = std::clamp(srcJ, 0, (width - 1));
         srcI = std::clamp(srcI, 0, (height - 1));
 
-        int srcIndex = (srcI * width * channels) + (srcJ * channels) + c;
-        int destIndex = (i * widthWithPadding * channels) + (j * channels) + c;
-
-        imageData[destIndex] = static_cast<float>(inputData[srcIndex]);
+        int srcIndex = (srcI * width * fileChannels) + (srcJ * fileChannels) + c;
+        imageData[image.index(i, j, c)] = (c < fileChannels)
+                                   ? static_cast<T>(inputData[srcIndex])
+                                   : static_cast<T>(255);
       }
     }
   }
 
   stbi_image_free(inputData);
 
-  return image_ref<float>{imageData, width, height, channels, halo};
+  return image;
+}
+
+// Number of channels stored in an image file, without decoding it.
+int image_channels(std::string imageFile) {
+  int width = 0, height = 0, channels = 0;
+  stbi_info(imageFile.c_str(), &width, &height, &channels);
+  return channels;
 }
 
-image_ref<float> allocate_image(int width, int height, int channels) {
-  float* imageData = new float[width * height * channels];
+template <typename T = float>
+image_ref<T> allocate_image(
+    int width, int height, int channels,
+    image_layout layout = image_layout::interleaved) {
+  T* imageData = new T[width * height * channels];
 
-  return image_ref<float>{imageData, width, height, channels, 0};
+  return image_ref<T>{imageData, width, height, channels, 0, layout};
 }
 
+// Writes the first `channels` channels of every pixel (all of them by
+// default), e.g. 3 to drop the channel read_image padded on.  The
+// file is always interleaved, whatever the image's layout.
 template <typename T>
-void write_image(const image_ref<T>& image, std::string imageFile) {
-  unsigned char* rawOutputData = new unsigned char[image.size()];
-  for (int i = 0; i < image.size(); ++i) {
-    rawOutputData[i] = static_cast<unsigned char>(image.data()[i]);
+void write_image(const image_ref<T>& image, std::string imageFile,
+                 int channels = 0) {
+  if (channels <= 0 || channels > image.channels()) channels = image.channels();
+
+  unsigned char* rawOutputData = new unsigned char[image.count() * channels];
+  for (int i = 0; i < image.height(); ++i) {
+    for (int j = 0; j < image.width(); ++j) {
+      for (int c = 0; c < channels; ++c) {
+        rawOutputData[((i * image.width()) + j) * channels + c] =
+            static_cast<unsigned char>(std::clamp<float>(
+                image.data()[image.index(i + image.halo(), j + image.halo(), c)],
+                0.0f, 255.0f));
+      }
+    }
+  }
+
+  stbi_write_png(imageFile.c_str(), image.width(), image.height(), channels,
+                 rawOutputData, 0);
+
+  delete[] rawOutputData;
+}
+
+// A Gaussian blur of standard deviation `sigma`, gaussian_width(sigma)
+// wide unless a width is given.  Colour channels are blurred, a fourth
+// (alpha) channel gets the identity, as with the box blur.
+image_ref<float> generate_gaussian(float sigma, int channels, int width = 0) {
+  if (width <= 0) width = gaussian_width(sigma);
+  auto taps = gaussian_taps(width, sigma);
+  float* filterData = new float[width * width * channels];
+
+  for (int j = 0; j < width; ++j) {
+    for (int i = 0; i < width; ++i) {
+      for (int c = 0; c < channels; ++c) {
+        auto isCenter = (j == (width / 2) && i == (width / 2));
+        filterData[(j * width + i) * channels + c] =
+            (c < 3) ? taps[j] * taps[i] : (isCenter ? 1.0f : 0.0f);
+      }
+    }
   }
 
-  stbi_write_png(imageFile.c_str(), image.width(), image.height(),
-                 image.channels(), rawOutputData, 0);
+  return image_ref<float>{filterData, width, width, channels, 0};
 }
 
   image_ref<float> generate_filter(filter_type filterType, int width, int channels) {
@@ -124,8 +278,16 @@ void write_image(const image_ref<T>& image, std::string imageFile) {
   assert( channels > 0 );
   assert( channels <= 4 );
 
+  // A gaussian_iir filter holds the taps the recursive engine
+  // approximates, and a bilateral one the weights by distance.
+  if (filterType == filter_type::gaussian ||
+      filterType == filter_type::gaussian_iir ||
+      filterType == filter_type::bilateral) {
+    return generate_gaussian(gaussian_sigma(width), channels, width);
+  }
+
   float* filterData = new float[size];
-  
+
   for (int j = 0; j < width; ++j) {
     for (int i = 0; i < width; ++i) {
       auto index = ((j * width * channels) + (i * channels));
@@ -141,6 +303,11 @@ void write_image(const image_ref<T>& image, std::string imageFile) {
 	    filterData[index + 3] = isCenter ? 1.0f : 0.0f;
           break;
         case filter_type::blur:
+        case filter_type::median:
+        case filter_type::erode:
+        case filter_type::dilate:
+        case filter_type::opening:
+        case filter_type::closing:
           filterData[index + 0] = 1.0f / static_cast<float>(count);
 	  if (channels>1)
 	    filterData[index + 1] = 1.0f / static_cast<float>(count);
@@ -149,6 +316,10 @@ void write_image(const image_ref<T>& image, std::string imageFile) {
 	  if (channels>3)
 	    filterData[index + 3] = isCenter ? 1.0f : 0.0f;
           break;
+        case filter_type::gaussian:
+        case filter_type::gaussian_iir:
+        case filter_type::bilateral:
+          break;  // generate_gaussian, above
       }
     }
   }
@@ -156,6 +327,400 @@ void write_image(const image_ref<T>& image, std::string imageFile) {
   return image_ref<float>{filterData, width, width, channels, 0};
 }
 
+// A user-supplied square kernel, as a single-channel filter of its
+// own width.  Files ending in .bin hold the weights as native 32-bit
+// floats, row by row; any other file is text, one row of weights per
+// line separated by white space, with # starting a comment and blank
+// lines ignored.  The first row sets the width; every row must match
+// it, and nothing may follow the last.  The weights are used as they
+// are, not normalized.
+image_ref<float> load_kernel(std::string filterFile) {
+  auto fail = [&](const std::string& why) {
+    std::cerr << "Filter file " << filterFile << ": " << why << "\n";
+    exit(1);
+  };
+
+  std::vector<float> weights;
+  bool binary = filterFile.size() >= 4 &&
+                filterFile.compare(filterFile.size() - 4, 4, ".bin") == 0;
+  std::ifstream in(filterFile, binary ? std::ios::binary : std::ios::in);
+  if (!in.is_open()) fail("cannot be opened.");
+  int size = 0;
+
+  if (binary) {
+    float weight;
+    while (in.read(reinterpret_cast<char*>(&weight), sizeof weight)) {
+      weights.push_back(weight);
+    }
+    if (in.gcount() != 0) fail("ends part-way through a weight.");
+    size = static_cast<int>(std::lround(std::sqrt(weights.size())));
+    if (weights.empty() ||
+        static_cast<std::size_t>(size) * size != weights.size()) {
+      fail("must hold a square kernel of weights.");
+    }
+  } else {
+    std::string line;
+    for (int lineNumber = 1; std::getline(in, line); ++lineNumber) {
+      std::istringstream fields(line.substr(0, line.find('#')));
+      std::vector<float> row;
+      float weight;
+      while (fields >> weight) row.push_back(weight);
+      std::string where = "line " + std::to_string(lineNumber) + " ";
+      if (!fields.eof()) fail(where + "holds something other than a weight.");
+      if (row.empty()) continue;
+      if (size == 0) size = static_cast<int>(row.size());
+      if (static_cast<int>(row.size()) != size) {
+        fail(where + "has " + std::to_string(row.size()) +
+             " weights; the kernel is " + std::to_string(size) + " wide.");
+      }
+      if (weights.size() == static_cast<std::size_t>(size) * size) {
+        fail(where + "follows the kernel's last row.");
+      }
+      weights.insert(weights.end(), row.begin(), row.end());
+    }
+    if (size == 0) fail("holds no weights.");
+    if (weights.size() != static_cast<std::size_t>(size) * size) {
+      fail("has " + std::to_string(weights.size() / size) +
+           " rows; the kernel is " + std::to_string(size) + " wide.");
+    }
+  }
+
+  float* filterData = new float[weights.size()];
+  std::copy(weights.begin(), weights.end(), filterData);
+  return image_ref<float>{filterData, size, size, 1, 0};
+}
+
+// A filter with `kernel` (single-channel) in every colour channel and
+// the identity in a fourth (alpha) channel, as generate_filter does.
+image_ref<float> kernel_filter(const image_ref<float>& kernel, int channels) {
+  int width = kernel.width();
+  float* filterData = new float[width * width * channels];
+
+  for (int j = 0; j < width; ++j) {
+    for (int i = 0; i < width; ++i) {
+      auto isCenter = (j == (width / 2) && i == (width / 2));
+      for (int c = 0; c < channels; ++c) {
+        filterData[(j * width + i) * channels + c] =
+            (c < 3) ? kernel.data()[j * width + i] : (isCenter ? 1.0f : 0.0f);
+      }
+    }
+  }
+
+  return image_ref<float>{filterData, width, width, channels, 0};
+}
+
+// Channel `channel` of a filter as a single-channel filter, for
+// running one plane of a planar image.
+image_ref<float> filter_channel(const image_ref<float>& filter, int channel) {
+  int count = filter.width() * filter.height();
+  float* filterData = new float[count];
+
+  for (int i = 0; i < count; ++i) {
+    filterData[i] = filter.data()[i * filter.channels() + channel];
+  }
+
+  return image_ref<float>{filterData, filter.width(), filter.height(), 1, 0};
+}
+
+// The two 1D factors of a separable filter, so that
+// filter(r, c) == column[r] * row[c] for every channel.  Both are
+// stored like the filter itself: index = tap * channels + channel.
+struct separable_filter {
+  std::vector<float> row;
+  std::vector<float> column;
+};
+
+// The 1D factor of generate_gaussian(sigma, channels, width), for both
+// passes, so a Gaussian needs no rank test to run separably.
+separable_filter gaussian_factors(float sigma, int channels, int width = 0) {
+  if (width <= 0) width = gaussian_width(sigma);
+  auto taps = gaussian_taps(width, sigma);
+  separable_filter factors;
+  factors.row.assign(width * channels, 0.0f);
+
+  for (int k = 0; k < width; ++k) {
+    for (int c = 0; c < channels; ++c) {
+      factors.row[k * channels + c] =
+          (c < 3) ? taps[k] : (k == width / 2 ? 1.0f : 0.0f);
+    }
+  }
+  factors.column = factors.row;
+  return factors;
+}
+
+// Channel `channel` of the factors of a `channels`-channel filter.
+separable_filter filter_channel(const separable_filter& factors, int channels,
+                                int channel) {
+  separable_filter single;
+  for (std::size_t k = channel; k < factors.row.size(); k += channels) {
+    single.row.push_back(factors.row[k]);
+    single.column.push_back(factors.column[k]);
+  }
+  return single;
+}
+
+// Rank-1 test of every channel of a square filter.  Returns the
+// factors when the filter can be run as two 1D passes, or nothing
+// when some channel needs the full 2D convolution.
+std::optional<separable_filter> separate_filter(const image_ref<float>& filter,
+                                                float tolerance = 1e-6f) {
+  int width = filter.width();
+  int channels = filter.channels();
+  const float* data = filter.data();
+
+  auto at = [&](int r, int c, int ch) {
+    return data[(r * width * channels) + (c * channels) + ch];
+  };
+
+  separable_filter factors;
+  factors.row.assign(width * channels, 0.0f);
+  factors.column.assign(width * channels, 0.0f);
+
+  for (int ch = 0; ch < channels; ++ch) {
+    // Factor around the largest weight; split its magnitude evenly
+    // between the two factors so neither ends up tiny.
+    int pivotR = 0, pivotC = 0;
+    for (int r = 0; r < width; ++r) {
+      for (int c = 0; c < width; ++c) {
+        if (std::fabs(at(r, c, ch)) > std::fabs(at(pivotR, pivotC, ch))) {
+          pivotR = r;
+          pivotC = c;
+        }
+      }
+    }
+
+    float pivot = at(pivotR, pivotC, ch);
+    if (pivot == 0.0f) continue;  // all zero, factors stay zero
+
+    float scale = std::sqrt(std::fabs(pivot));
+    for (int k = 0; k < width; ++k) {
+      factors.row[k * channels + ch] = at(pivotR, k, ch) / scale;
+      factors.column[k * channels + ch] = at(k, pivotC, ch) * scale / pivot;
+    }
+
+    for (int r = 0; r < width; ++r) {
+      for (int c = 0; c < width; ++c) {
+        float product = factors.column[r * channels + ch] *
+                        factors.row[c * channels + ch];
+        if (std::fabs(at(r, c, ch) - product) > tolerance * std::fabs(pivot)) {
+          return std::nullopt;
+        }
+      }
+    }
+  }
+
+  return factors;
+}
+
+// How far two 1D passes with `factors` can land from the full
+// convolution with `filter`: the largest, over channels, of the summed
+// differences between the taps and the factors' products, i.e. the
+// error per unit of input range.  Factors holding several terms one
+// after the other (low_rank_filter) are summed first.
+float factor_error(const image_ref<float>& filter,
+                   const separable_filter& factors) {
+  int width = filter.width();
+  int channels = filter.channels();
+  int terms = static_cast<int>(factors.row.size()) / (width * channels);
+  float worst = 0.0f;
+
+  for (int ch = 0; ch < channels; ++ch) {
+    float error = 0.0f;
+    for (int r = 0; r < width; ++r) {
+      for (int c = 0; c < width; ++c) {
+        float product = 0.0f;
+        for (int t = 0; t < terms; ++t) {
+          int offset = t * width * channels;
+          product += factors.column[offset + r * channels + ch] *
+                     factors.row[offset + c * channels + ch];
+        }
+        error += std::fabs(filter.data()[(r * width + c) * channels + ch] -
+                           product);
+      }
+    }
+    worst = std::max(worst, error);
+  }
+  return worst;
+}
+
+// A filter that isn't separable, written as a sum of separable terms
+// from its singular value decomposition: term k of a channel is sqrt(sigma_k)
+// times the k-th left singular vector (column) and sqrt(sigma_k) times
+// the k-th right one (row), largest sigma first.  Every channel takes
+// terms until it is within `tolerance` of the taps, measured as
+// factor_error does; channels that need fewer than the others get zero
+// terms.  The terms are stored one after the other, term t's factors
+// from t * width * channels on.  Nothing when some channel needs more
+// than maxRank terms.
+std::optional<separable_filter> low_rank_filter(const image_ref<float>& filter,
+                                                float tolerance, int maxRank) {
+  int width = filter.width();
+  int channels = filter.channels();
+  int termSize = width * channels;
+  separable_filter terms;
+
+  for (int ch = 0; ch < channels; ++ch) {
+    // One-sided Jacobi: rotate pairs of columns of u (the filter, to
+    // begin with) until they are all orthogonal, applying the same
+    // rotations to v (the identity).  Then u * transpose(v) is still
+    // the filter, column k of u is sigma_k times a left singular
+    // vector and column k of v the matching right one.
+    std::vector<double> u(width * width), v(width * width, 0.0);
+    for (int k = 0; k < width * width; ++k) {
+      u[k] = filter.data()[k * channels + ch];
+    }
+    for (int k = 0; k < width; ++k) v[k * width + k] = 1.0;
+
+    for (int sweep = 0; sweep < 64; ++sweep) {
+      bool rotated = false;
+      for (int p = 0; p < width; ++p) {
+        for (int q = p + 1; q < width; ++q) {
+          double alpha = 0.0, beta = 0.0, gamma = 0.0;
+          for (int r = 0; r < width; ++r) {
+            alpha += u[r * width + p] * u[r * width + p];
+            beta += u[r * width + q] * u[r * width + q];
+            gamma += u[r * width + p] * u[r * width + q];
+          }
+          if (std::fabs(gamma) <= 1e-15 * std::sqrt(alpha * beta)) continue;
+          rotated = true;
+          double zeta = (beta - alpha) / (2.0 * gamma);
+          double t = std::copysign(1.0, zeta) /
+                     (std::fabs(zeta) + std::sqrt(1.0 + zeta * zeta));
+          double cs = 1.0 / std::sqrt(1.0 + t * t);
+          double sn = cs * t;
+          for (auto* m : {&u, &v}) {
+            for (int r = 0; r < width; ++r) {
+              double mp = (*m)[r * width + p];
+              double mq = (*m)[r * width + q];
+              (*m)[r * width + p] = cs * mp - sn * mq;
+              (*m)[r * width + q] = sn * mp + cs * mq;
+            }
+          }
+        }
+      }
+      if (!rotated) break;
+    }
+
+    std::vector<double> sigmas(width, 0.0);
+    std::vector<int> order(width);
+    for (int k = 0; k < width; ++k) {
+      for (int r = 0; r < width; ++r) {
+        sigmas[k] += u[r * width + k] * u[r * width + k];
+      }
+      sigmas[k] = std::sqrt(sigmas[k]);
+      order[k] = k;
+    }
+    std::sort(order.begin(), order.end(),
+              [&](int a, int b) { return sigmas[a] > sigmas[b]; });
+
+    // Take terms while the residual is too big.
+    std::vector<double> residual(width * width);
+    for (int k = 0; k < width * width; ++k) {
+      residual[k] = filter.data()[k * channels + ch];
+    }
+    auto error = [&] {
+      double sum = 0.0;
+      for (double e : residual) sum += std::fabs(e);
+      return sum;
+    };
+    for (int rank = 0; error() > tolerance; ++rank) {
+      if (rank == std::min(maxRank, width) || sigmas[order[rank]] == 0.0) {
+        return std::nullopt;
+      }
+      if (rank * termSize == static_cast<int>(terms.row.size())) {
+        terms.row.resize(terms.row.size() + termSize, 0.0f);
+        terms.column.resize(terms.column.size() + termSize, 0.0f);
+      }
+      int k = order[rank];
+      double scale = std::sqrt(sigmas[k]);
+      for (int r = 0; r < width; ++r) {
+        float column = static_cast<float>(u[r * width + k] / scale);
+        float row = static_cast<float>(v[r * width + k] * scale);
+        terms.column[rank * termSize + r * channels + ch] = column;
+        terms.row[rank * termSize + r * channels + ch] = row;
+      }
+      for (int r = 0; r < width; ++r) {
+        for (int c = 0; c < width; ++c) {
+          residual[r * width + c] -=
+              static_cast<double>(terms.column[rank * termSize +
+                                               r * channels + ch]) *
+              terms.row[rank * termSize + c * channels + ch];
+        }
+      }
+    }
+  }
+
+  if (terms.row.empty()) {  // an all-zero filter, one zero term
+    terms.row.assign(termSize, 0.0f);
+    terms.column.assign(termSize, 0.0f);
+  }
+  return terms;
+}
+
+// Per-channel weight of a box filter, one whose factors are constant
+// within every channel, so that each output sample is weight times
+// the plain sum of its window.  Returns nothing for any other
+// separable filter (e.g. the identity alpha channel of an RGBA blur).
+std::optional<std::vector<float>> box_weights(const separable_filter& factors,
+                                              int channels,
+                                              float tolerance = 1e-6f) {
+  int width = static_cast<int>(factors.row.size()) / channels;
+  std::vector<float> weights(channels);
+
+  for (int ch = 0; ch < channels; ++ch) {
+    float row = factors.row[ch];
+    float column = factors.column[ch];
+    for (int k = 1; k < width; ++k) {
+      if (std::fabs(factors.row[k * channels + ch] - row) >
+              tolerance * std::fabs(row) ||
+          std::fabs(factors.column[k * channels + ch] - column) >
+              tolerance * std::fabs(column)) {
+        return std::nullopt;
+      }
+    }
+    weights[ch] = row * column;
+  }
+
+  return weights;
+}
+
+// Host reference FFT: in place, radix 2, over the n elements of
+// data[0], data[stride], ... (n a power of two).  The inverse is
+// unscaled.
+void fft(std::complex<double>* data, int n, int stride, bool inverse) {
+  for (int i = 1, j = 0; i < n; ++i) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) std::swap(data[i * stride], data[j * stride]);
+  }
+
+  double pi = std::acos(-1.0);
+  for (int m = 2; m <= n; m *= 2) {
+    double angle = (inverse ? 2.0 : -2.0) * pi / m;
+    for (int k = 0; k < n; k += m) {
+      for (int j = 0; j < m / 2; ++j) {
+        auto w = std::polar(1.0, angle * j);
+        auto a = data[(k + j) * stride];
+        auto b = data[(k + j + m / 2) * stride] * w;
+        data[(k + j) * stride] = a + b;
+        data[(k + j + m / 2) * stride] = a - b;
+      }
+    }
+  }
+}
+
+// 2D FFT of a rows x columns grid stored row by row.
+void fft2d(std::vector<std::complex<double>>& grid, int rows, int columns,
+           bool inverse) {
+  for (int r = 0; r < rows; ++r) {
+    fft(grid.data() + r * columns, columns, 1, inverse);
+  }
+  for (int c = 0; c < columns; ++c) {
+    fft(grid.data() + c, rows, columns, inverse);
+  }
+}
+
 }  // namespace util
 
 #endif  // __IMAGE_CONV_H__